@@ -3,25 +3,25 @@
 #include <iostream>
 
 
+constexpr bool Fl_MIDIKeyboard::BLACK_NOTES[12];
+constexpr bool Fl_MIDIKeyboard::CF_NOTES[12];
+constexpr uchar Fl_MIDIKeyboard::WHITES_BEFORE[12];
+
+double Fl_MIDIKeyboard::_frame_interval = DEFAULT_FRAME_INTERVAL;
+std::vector<Fl_MIDIKeyboard*> Fl_MIDIKeyboard::_frame_queue;
+std::vector<Fl_MIDIKeyboard*>* Fl_MIDIKeyboard::_frame_ticking = 0;
+
+
 //
 //      Static functions
 //
 
 
 int Fl_MIDIKeyboard::white_keys(uchar from, uchar to) {
-    int nkeys = 0;
-
     if (is_black(from)) from--;     // if from or to are black, start with white keys
     if (is_black(to)) to++;
-    while (from + 12 <= to) {
-        nkeys += 7;
-        from += 12;
-    }
-    while (from <= to) {
-        if (!is_black(from)) nkeys++;
-        from++;
-    }
-    return nkeys;
+    if (from > to) return 0;
+    return whites_below(to + 1) - whites_below(from);
 }
 
 
@@ -65,7 +65,12 @@ const char* Fl_MIDIKeyboard::number_to_note(uchar k) {
 //
 
 Fl_MIDIKeyboard::Fl_MIDIKeyboard (int X, int Y, int W, int H, const char *l) :
+    Fl_MIDIKeyboard(X, Y, W, H, MIDI_OUTPUT, l) {}
+
+
+Fl_MIDIKeyboard::Fl_MIDIKeyboard (int X, int Y, int W, int H, DriverMode mode, const char *l) :
     Fl_Scroll(X, Y, W, H, l),
+    MKB_MIDIDriver(mode),
     _bw_height_ratio(DEFAULT_BW_HEIGHT_RATIO),
     _bw_width_ratio(DEFAULT_BW_WIDTH_RATIO),
     _autoresize(false),
@@ -73,7 +78,26 @@ Fl_MIDIKeyboard::Fl_MIDIKeyboard (int X, int Y, int W, int H, const char *l) :
     _kw_resize_min(DEFAULT_KW_RESIZE_MIN),
     _kw_resize_max(DEFAULT_KW_RESIZE_MAX),
     _base_keyinput(MIDDLE_C),
-    _autodrag(false) {
+    _autodrag(false),
+    _npressed(0),
+    _minpressed(0),
+    _maxpressed(0),
+    _layout(0),
+    _layout_w(0),
+    _layout_h(0),
+    _layout_valid(false),
+    _marker_w(0),
+    _marker_b(0),
+    _marker_diam(0),
+    _frame_pending(false),
+    _coalesced_frames(0),
+    _painted_frames(0),
+    _update_level(0),
+    _update_pending(false),
+    _notifying(0),
+    _batch_pending(false),
+    _batch_types(0),
+    _in_pending(false) {
 
     box(FL_DOWN_FRAME);
     _type = (W >= H) ? MKB_HORIZONTAL : MKB_VERTICAL;   // set horizontal/vertical
@@ -82,27 +106,52 @@ Fl_MIDIKeyboard::Fl_MIDIKeyboard (int X, int Y, int W, int H, const char *l) :
     keyboard->box(FL_BORDER_BOX);
     keyboard->color(FL_WHITE);
     end();
+    memset(dirty_keys, 0, sizeof(dirty_keys));
 
     set_key_height();                                   // set keys width and height
     _key_width = _old_k_width = _key_height * DEFAULT_WH_RATIO;
     _b_width = (int)(_key_width * _bw_width_ratio);
     hscrollbar.callback(hscrollbar_cb);                 // set scrollbar callbacks to overriden functions
     scrollbar.callback(scrollbar_cb);
+    begin_update();                                     // compute the layout only once
     set_range(MKB_2OCTAVE);                             // default : two octaves range
     scroll_mode(MKB_SCROLL_KEYS);                       // default : scrolling only with PGUP/PGDOWN
     press_mode(MKB_PRESS_NONE);                         // default : playing not active
+    end_update();                                       // this also centers the keyboard
 
-    center_keyboard();
     _below_mouse = find_key(Fl::event_x(), Fl::event_y());
 }
 
 
+Fl_MIDIKeyboard::~Fl_MIDIKeyboard() {
+    StopNotifications();                                // the driver threads call our functions
+    unqueue_frame();
+    if (_batch_pending)
+        Fl::remove_timeout(batch_cb, this);
+    if (_layout)
+        fl_delete_offscreen(_layout);
+    delete _marker_w;
+    delete _marker_b;
+}
+
+
 //
 //      Other public functions
 //
 
 
 
+void Fl_MIDIKeyboard::end_update() {
+    if (_update_level == 0 || --_update_level > 0)
+        return;
+    if (_update_pending) {
+        _update_pending = false;
+        set_keyboard_width();                           // sets scrollbars, keys height and visible keys
+        redraw();
+    }
+}
+
+
 void Fl_MIDIKeyboard::key_width(float w) {
     resize_mode(false);                                 // resizing will be manual, so no autoresize
     _key_width = _old_k_width = w;                      // set white keys width
@@ -117,6 +166,7 @@ void  Fl_MIDIKeyboard::bw_height_ratio(float r) {
     if (20 <= percent && percent <= 80) {
         _bw_height_ratio = r;
         _b_height = (int)(_key_height * _bw_height_ratio);  // set black keys height
+        invalidate_layout();
         redraw();
     }
 }
@@ -187,6 +237,10 @@ bool Fl_MIDIKeyboard::set_range(int r) {
 
 void Fl_MIDIKeyboard::scroll_mode(char c) {
     _scrollmode = c;
+    if (_update_level) {                        // inside begin_update() / end_update()
+        _update_pending = true;
+        return;
+    }
     if (_total_width <= kbdw()) {               // if the keyboard is smaller then the widget. hides the scrollbars
         Fl_Scroll::type(0);
         scrollbar.hide();
@@ -222,7 +276,7 @@ void Fl_MIDIKeyboard::press_mode(char c)  {
     if (_pressmode == MKB_PRESS_NONE)
         CloseMIDIOutPort();
     else
-        OpenMIDIOutPort();
+        OpenMIDIOutPortAsync();                        // don't block the GUI
 }
 
 
@@ -240,11 +294,11 @@ void Fl_MIDIKeyboard::key_position(uchar k) {
     if (k < _firstkey) k = _firstkey;
     else if (k > _maxbottom) k = _maxbottom;
     if(_type == MKB_HORIZONTAL)
-        kbd_position(_total_width <= kbdw() ? 0 : keyscoord[k]);
+        kbd_position(_total_width <= kbdw() ? 0 : _geom.offs[k]);
     else
-        kbd_position(_total_width <= kbdw() ? 0 : _total_width - kbdw() - keyscoord[k]);
-//    cout << "_total_width = " << _total_width << "  k = " << (int)k << " coords[k] = " << keyscoord[k] << "  h() = " << h()
-//    << "  t_w - keysc - h = " << _total_width - keyscoord[k] - h()+ Fl::box_dh(box()) << endl;
+        kbd_position(_total_width <= kbdw() ? 0 : _total_width - kbdw() - _geom.offs[k]);
+//    cout << "_total_width = " << _total_width << "  k = " << (int)k << " coords[k] = " << _geom.offs[k] << "  h() = " << h()
+//    << "  t_w - keysc - h = " << _total_width - _geom.offs[k] - h()+ Fl::box_dh(box()) << endl;
 }
 
 
@@ -269,23 +323,67 @@ void Fl_MIDIKeyboard::center_keyboard(uchar k) {
 }
 
 
-void Fl_MIDIKeyboard::set_pressed_status(bool* keys_array) {
-    memcpy(pressed_keys, keys_array, sizeof(pressed_keys));
-    _npressed = 0;
-    _minpressed = 0;
-    _maxpressed = 0;
-    for (int i = 0; i < 128; i++) {
-        if (!pressed_keys[i]) continue;
-        if (!_npressed) _minpressed = i;
-        _npressed++;
-        _maxpressed = i;
+void Fl_MIDIKeyboard::set_pressed_status(const bool* keys_array) {
+    set_pressed_status(MKB_KeySet(keys_array));
+}
+
+
+void Fl_MIDIKeyboard::set_pressed_status(const MKB_KeySet& keys) {
+    MKB_KeySet changed = pressed_keys.diff(keys);
+    for (int i = changed.next(0); i != -1; i = changed.next(i + 1))
+        damage_key(i);                                  // repaint only the changed keys
+    MKB_KeySet old = pressed_keys;
+    pressed_keys = keys;
+    update_pressed();
+    if (!changed.empty()) {
+        _changed_keys = changed;
+        notify(MKB_SYNC, 0, changed & keys, changed & old);
     }
-    redraw();
 }
 
 
-void Fl_MIDIKeyboard::get_pressed_status(const bool* keys_array, uchar& n, uchar& min, uchar& max) {
-    keys_array = pressed_keys;
+void Fl_MIDIKeyboard::sync_pressed_status(const MKB_KeySet& keys, bool send_midi /* = true */) {
+    MKB_KeySet changed = pressed_keys.diff(keys);
+    if (changed.empty()) return;
+    MKB_KeySet released = changed & pressed_keys;
+    MKB_KeySet pressed = changed & keys;
+
+    if (send_midi) {                                    // play all the changes in a single MIDI group
+        Msg msgs[128];
+        size_t n = 0;
+        for (int i = released.next(0); i != -1; i = released.next(i + 1)) {
+            msgs[n].status = NOTE_OFF | channel;
+            msgs[n].data1 = i;
+            msgs[n++].data2 = 0;
+        }
+        for (int i = pressed.next(0); i != -1; i = pressed.next(i + 1)) {
+            msgs[n].status = NOTE_ON | channel;
+            msgs[n].data1 = i;
+            msgs[n++].data2 = note_vel;
+        }
+        SendMIDIMessages(msgs, n);
+    }
+
+    for (int i = changed.next(0); i != -1; i = changed.next(i + 1))
+        damage_key(i);                                  // repaint only the changed keys
+    pressed_keys = keys;
+    update_pressed();
+    _changed_keys = changed;
+    notify(MKB_SYNC, 0, pressed, released);
+    if (((when() & MKB_WHEN_PRESS) && !pressed.empty()) || ((when() & MKB_WHEN_RELEASE) && !released.empty())) {
+        _callback_status = MKB_SYNC;
+        do_callback();
+    }
+}
+
+
+void Fl_MIDIKeyboard::sync_pressed_status(const bool* keys_array, bool send_midi /* = true */) {
+    sync_pressed_status(MKB_KeySet(keys_array), send_midi);
+}
+
+
+void Fl_MIDIKeyboard::get_pressed_status(bool* keys_array, uchar& n, uchar& min, uchar& max) const {
+    pressed_keys.to_array(keys_array);
     n = _npressed;
     min = _minpressed;
     max = _maxpressed;
@@ -294,11 +392,12 @@ void Fl_MIDIKeyboard::get_pressed_status(const bool* keys_array, uchar& n, uchar
 
 void Fl_MIDIKeyboard::clear_pressed_status() {
     if (_npressed) {
-        memset(pressed_keys, 0, sizeof(bool[128]));
-        _npressed = 0;
-        _minpressed = 0;
-        _maxpressed = 0;
-        redraw();
+        for (int i = pressed_keys.next(0); i != -1; i = pressed_keys.next(i + 1))
+            damage_key(i);
+        MKB_KeySet old = pressed_keys;
+        pressed_keys.clear();
+        update_pressed();
+        notify(MKB_CLEAR, 0, MKB_KeySet(), old);
         if(when() & MKB_WHEN_RELEASE) {
             _callback_status = MKB_CLEAR;
             do_callback();
@@ -308,16 +407,16 @@ void Fl_MIDIKeyboard::clear_pressed_status() {
 
 
 void Fl_MIDIKeyboard::press_key(uchar k) {
-    if (!pressed_keys[k]) {
+    if (!pressed_keys.test(k)) {
 
         NoteOn(k);                          // play the key with the MIDI driver
 
-        pressed_keys[k] = true;             // adjust the pressed status variables
-        _npressed++;
-        if (_npressed == 1) _maxpressed = _minpressed = k;
-        else if (k > _maxpressed) _maxpressed = k;
-        else if (k < _minpressed) _minpressed = k;
-        redraw();
+        pressed_keys.set(k);                // adjust the pressed status variables
+        update_pressed();
+        damage_key(k);
+        MKB_KeySet key;
+        key.set(k);
+        notify(MKB_PRESS, k, key, MKB_KeySet());
         if (when() & MKB_WHEN_PRESS) {
             _callback_status = MKB_PRESS | k;
             do_callback();                  // if needed, calls the callback
@@ -328,25 +427,16 @@ void Fl_MIDIKeyboard::press_key(uchar k) {
 
 
 void Fl_MIDIKeyboard::release_key(uchar k) {
-    if (pressed_keys[k]) {
+    if (pressed_keys.test(k)) {
 
         NoteOff(k);
 
-        pressed_keys[k] = false;
-        _npressed--;
-        if (_npressed) {
-            if (k == _maxpressed) {
-                do k--;
-                    while (!pressed_keys[k]);
-                _maxpressed = k;
-            }
-            else if (k == _minpressed) {
-                do k++;
-                    while (!pressed_keys[k]);
-                _minpressed = k;
-            }
-        }
-        redraw();
+        pressed_keys.reset(k);
+        update_pressed();
+        damage_key(k);
+        MKB_KeySet key;
+        key.set(k);
+        notify(MKB_RELEASE, k, MKB_KeySet(), key);
         if (when() & MKB_WHEN_RELEASE) {
             _callback_status = MKB_RELEASE | k;
             do_callback();
@@ -356,7 +446,154 @@ void Fl_MIDIKeyboard::release_key(uchar k) {
 }
 
 
+void Fl_MIDIKeyboard::press_chord(const uchar* keys, uchar n) {
+    uchar chord[128];
+    uchar nchord = 0;
+    for (uchar i = 0; i < n; i++) {                 // select the keys not already pressed
+        uchar k = keys[i] & 0x7f;
+        if (pressed_keys.test(k)) continue;
+        pressed_keys.set(k);
+        damage_key(k);
+        chord[nchord++] = k;
+    }
+    if (!nchord) return;
+
+    NotesOn(chord, nchord);                         // play all the keys in a single MIDI group
+
+    update_pressed();                               // adjust the pressed status variables
+    MKB_KeySet changed;
+    for (uchar i = 0; i < nchord; i++)
+        changed.set(chord[i]);
+    _changed_keys = changed;
+    notify(MKB_SYNC, 0, changed, MKB_KeySet());
+    if (when() & MKB_WHEN_PRESS) {
+        for (uchar i = 0; i < nchord; i++) {
+            _callback_status = MKB_PRESS | chord[i];
+            do_callback();
+        }
+    }
+}
+
+
+void Fl_MIDIKeyboard::release_chord(const uchar* keys, uchar n) {
+    uchar chord[128];
+    uchar nchord = 0;
+    for (uchar i = 0; i < n; i++) {                 // select the pressed keys
+        uchar k = keys[i] & 0x7f;
+        if (!pressed_keys.test(k)) continue;
+        pressed_keys.reset(k);
+        damage_key(k);
+        chord[nchord++] = k;
+    }
+    if (!nchord) return;
+
+    NotesOff(chord, nchord);
+
+    update_pressed();
+    MKB_KeySet changed;
+    for (uchar i = 0; i < nchord; i++)
+        changed.set(chord[i]);
+    _changed_keys = changed;
+    notify(MKB_SYNC, 0, MKB_KeySet(), changed);
+    if (when() & MKB_WHEN_RELEASE) {
+        for (uchar i = 0; i < nchord; i++) {
+            _callback_status = MKB_RELEASE | chord[i];
+            do_callback();
+        }
+    }
+}
+
+
+void Fl_MIDIKeyboard::add_listener(Listener fn, void* p, int mask /* = MKB_ALL_EVENTS */,
+                                   int mode /* = MKB_IMMEDIATE */) {
+    ListenerEntry l = { fn, p, mask, mode };
+    _listeners.push_back(l);
+}
+
+
+void Fl_MIDIKeyboard::remove_listener(Listener fn, void* p) {
+    for (size_t i = 0; i < _listeners.size(); i++) {
+        if (_listeners[i].fn != fn || _listeners[i].p != p) continue;
+        if (_notifying)
+            _listeners[i].fn = 0;                       // erased at the end of notify()
+        else
+            _listeners.erase(_listeners.begin() + i);
+        return;
+    }
+}
+
+
+void Fl_MIDIKeyboard::notify(int type, uchar note, const MKB_KeySet& pressed, const MKB_KeySet& released) {
+    if (_listeners.empty()) return;
+    Event e;
+    e.type = type;
+    e.note = note;
+    e.pressed = pressed;
+    e.released = released;
+    bool batched = false;
+    _notifying++;
+    for (size_t i = 0; i < _listeners.size(); i++) {
+        ListenerEntry l = _listeners[i];                // a copy: the listener can add other listeners
+        if (!l.fn || !(l.mask & type)) continue;
+        if (l.mode == MKB_BATCHED)
+            batched = true;
+        else
+            l.fn(this, e, l.p);
+    }
+    if (--_notifying == 0)
+        purge_listeners();
+    if (batched) {
+        if (!_batch_pending) {                          // the first event of this turn
+            _batch_start = pressed_keys ^ pressed ^ released;
+            _batch_pending = true;
+            Fl::add_timeout(0.0, batch_cb, this);
+        }
+        _batch_types |= type;
+    }
+}
+
+
+void Fl_MIDIKeyboard::batch_cb(void* p) {
+    Fl_MIDIKeyboard* kb = (Fl_MIDIKeyboard*)p;
+    kb->_batch_pending = false;
+    MKB_KeySet changed = kb->_batch_start.diff(kb->pressed_keys);
+    Event e;
+    e.note = 0;
+    e.pressed = changed & kb->pressed_keys;
+    e.released = changed & kb->_batch_start;
+    int types = kb->_batch_types;
+    kb->_batch_types = 0;
+    kb->_notifying++;
+    for (size_t i = 0; i < kb->_listeners.size(); i++) {
+        ListenerEntry l = kb->_listeners[i];
+        if (!l.fn || l.mode != MKB_BATCHED || !(l.mask & types)) continue;
+        e.type = l.mask & types;
+        l.fn(kb, e, l.p);
+    }
+    if (--kb->_notifying == 0)
+        kb->purge_listeners();
+}
+
+
+void Fl_MIDIKeyboard::purge_listeners() {
+    for (size_t i = _listeners.size(); i > 0; i--)
+        if (!_listeners[i - 1].fn)
+            _listeners.erase(_listeners.begin() + i - 1);
+}
+
+
+void Fl_MIDIKeyboard::update_pressed() {
+    _npressed = pressed_keys.count();
+    _minpressed = _npressed ? pressed_keys.min() : 0;
+    _maxpressed = _npressed ? pressed_keys.max() : 0;
+}
+
+
 void Fl_MIDIKeyboard::set_keyboard_width(void) {
+    if (_update_level) {                                // inside begin_update() / end_update()
+        _update_pending = true;
+        return;
+    }
     bool _maxbottom_found = false;
 
     //_total_width = (int)(_key_width * _white_keys);
@@ -412,10 +649,21 @@ void Fl_MIDIKeyboard::set_keyboard_width(void) {
 
     float offs = 0.0;
     for (uchar i = _firstkey; i <= _lastkey; i++) {
-        keyscoord[i] = (int)offs;
-        if (is_black(i)) keyscoord[i] -= (int)(_b_width / 2);
-        else offs += _key_width;
+        _geom.black[i] = is_black(i);
+        _geom.offs[i] = (int)offs;
+        if (_geom.black[i]) {
+            _geom.offs[i] -= (int)(_b_width / 2);
+            _geom.width[i] = _b_width;
+            _geom.line[i] = KeyLayout::LINE_NONE;
+        }
+        else {
+            offs += _key_width;
+            _geom.width[i] = (int)offs - _geom.offs[i];     // up to the next white key
+            _geom.line[i] = isCF(i) ? KeyLayout::LINE_FULL : KeyLayout::LINE_SHORT;
+        }
     }
+    build_hit_tables();
+    invalidate_layout();
     if (!_maxbottom_found)
         _maxbottom = find_key_from_offset(_total_width - kbdw(), false);
     center_keyboard();                                  // calls redraw()
@@ -432,28 +680,19 @@ void Fl_MIDIKeyboard::set_key_height() {
         _key_height = keyboard->w();
     }
      _b_height = (int)(_key_height * _bw_height_ratio);
+     invalidate_layout();
 }
 
 
 
 uchar Fl_MIDIKeyboard::find_key_from_offset(int off, bool low) {
     if (off < 0 || off > _total_width) return 0;
-    uchar min = _firstkey;                                      // binary search
-    uchar max = _lastkey;
-    uchar mid = min + (max - min) / 2;
-    if (off >= keyscoord[max]) mid = max;
-    else {
-        do {
-            if (off >= keyscoord[mid]) min = mid;
-            else max = mid;
-            mid = min + (max - min) / 2;
-        } while (max - min > 1);
-    }
+    uchar mid = _geom.at[off];
     if (low && mid > _firstkey) {
                     // if a black and a white key overlap and low == true, the function returns
                     // the lower key, else the upper
-        if (is_black(mid-1) && keyscoord[mid-1]+_b_width > off) mid--;
-        else if (!is_black(mid-1) && keyscoord[mid-1]+_key_width > off) mid--;
+        if (_geom.black[mid-1] && _geom.offs[mid-1]+_b_width > off) mid--;
+        else if (!_geom.black[mid-1] && _geom.offs[mid-1]+_key_width > off) mid--;
     }
     return mid;
 }
@@ -463,35 +702,32 @@ short Fl_MIDIKeyboard::find_key(int X, int Y) {
     X -= keyboard->x();
     Y = (_type == MKB_HORIZONTAL ? Y - keyboard->y() : keyboard->y() + keyboard->h() - Y);
     if (X < 0 || Y < 0 || X > keyboard->w() || Y > keyboard->h()) return -1;
-    uchar min = _firstkey;                                      // binary search
-    uchar max = _lastkey;
-    uchar mid = min + (max - min) / 2;
-    if(_type == MKB_HORIZONTAL) {
-        if (X >= keyscoord[max]) return max;
-        do {
-            if (X >= keyscoord[mid]) min = mid;
-            else max = mid;
-            mid = min + (max - min) / 2;
-        } while (max - min > 1);
-        if (Y > _b_height) return (is_black(min) ? mid -1 : mid);   // (X, Y) is below black keys
-        else if (is_black(mid)) return mid;                         // (X, Y) is on the left side of a black key
-        else if (isCF(mid)) return mid;                             // (X, Y) is on a C or F
-        else if (X - keyscoord[mid] <= _b_width / 2 && mid > _firstkey) return mid - 1;
-                                                                    // (X, Y) is on the right side of a black key
-        else return mid;                                            // (X, Y) is between two black keys
-    }
-    else {
-        if (Y >= keyscoord[max]) return max;
-        do {
-            if (Y >= keyscoord[mid]) min = mid;
-            else max = mid;
-            mid = min + (max - min) / 2;
-        } while (max - min > 1);
-        if (X > _b_height) return (is_black(min) ? mid -1 : mid);
-        else if (is_black(mid)) return mid;
-        else if (isCF(mid)) return mid;
-        else if (Y - keyscoord[mid] <= _b_width / 2 && mid > _firstkey) return mid - 1;
-        else return mid;
+    int off = (_type == MKB_HORIZONTAL ? X : Y);                // along the keyboard
+    int depth = (_type == MKB_HORIZONTAL ? Y : X);              // along the keys
+    if (off >= (int)_geom.wzone.size()) return -1;
+    return depth > _b_height ? _geom.wzone[off] : _geom.bzone[off];
+}
+
+
+void Fl_MIDIKeyboard::build_hit_tables() {
+    _geom.at.resize(_total_width + 1);
+    _geom.bzone.resize(_total_width + 1);
+    _geom.wzone.resize(_total_width + 1);
+    uchar k = _firstkey;                                        // the last key beginning at off or before
+    for (int off = 0; off <= _total_width; off++) {
+        while (k < _lastkey && _geom.offs[k + 1] <= off) k++;
+        _geom.at[off] = k;
+        if (k == _lastkey) {
+            _geom.bzone[off] = _geom.wzone[off] = _lastkey;
+            continue;
+        }
+        _geom.wzone[off] = _geom.black[k] ? k - 1 : k;          // below black keys
+        if (_geom.black[k] || _geom.line[k] == KeyLayout::LINE_FULL)
+            _geom.bzone[off] = k;                               // on a black key, or on a C or F
+        else if (off - _geom.offs[k] <= _b_width / 2 && k > _firstkey)
+            _geom.bzone[off] = k - 1;                           // on the right side of a black key
+        else
+            _geom.bzone[off] = k;                               // between two black keys
     }
 }
 
@@ -598,6 +834,7 @@ int Fl_MIDIKeyboard::handle(int e) {
             return 1;
 
         case FL_FOCUS :
+            notify(MKB_FOCUS, 0, MKB_KeySet(), MKB_KeySet());
             if (when() & MKB_WHEN_FOCUS) {
                 _callback_status = MKB_FOCUS;
                 do_callback();
@@ -605,6 +842,7 @@ int Fl_MIDIKeyboard::handle(int e) {
             return 1;
         case FL_UNFOCUS :
             clear_pressed_status();
+            notify(MKB_UNFOCUS, 0, MKB_KeySet(), MKB_KeySet());
             if (when() & MKB_WHEN_FOCUS) {
                 _callback_status = MKB_UNFOCUS;
                 do_callback();
@@ -689,11 +927,11 @@ int Fl_MIDIKeyboard::handle(int e) {
                 offs += _base_keyinput;             // get the actual MIDI note number
                 if (offs < _firstkey || offs > _lastkey)    // the key is not in the extension
                     return 0;
-                if (e == FL_KEYDOWN && !pressed_keys[offs]) {
+                if (e == FL_KEYDOWN && !pressed_keys.test(offs)) {
                     //cout << "handle  Pressed " << (char)offs << "  ";
                     press_key (offs);
                 }
-                if (e == FL_KEYUP && pressed_keys[offs]) {
+                if (e == FL_KEYUP && pressed_keys.test(offs)) {
                     //cout << "handle  Released " << (char)offs << "  ";
                     release_key(offs);
                 }
@@ -714,64 +952,269 @@ void Fl_MIDIKeyboard::resize(int X, int Y, int W, int H) {	// fltk resize() over
 
 
 void Fl_MIDIKeyboard::draw(void) {                          // fltk draw() override
-    Fl_Scroll::draw();
+    _painted_frames++;
+    uchar bk = is_black(_bottomkey) ? _bottomkey-1 : _bottomkey;    // need to begin with a white key
+    update_layout();
+    if ((damage() & ~FL_DAMAGE_USER1) != 0)                 // not only some keys changed
+        Fl_Scroll::draw();
 
     fl_push_clip(x()+Fl::box_dx(box()), y()+Fl::box_dy(box()), w()-Fl::box_dw(box()), h()-Fl::box_dh(box()));
+    int X, Y, W, H;
+    if ((damage() & ~FL_DAMAGE_USER1) == 0) {
+        for (int i = bk; i <= _topkey; i++) {               // repaint only the changed keys
+            if (!dirty_keys[i]) continue;
+            key_rect(i, X, Y, W, H);
+            fl_push_clip(X, Y, W, H);
+            fl_clip_box(X, Y, W, H, X, Y, W, H);
+            if (W > 0 && H > 0)                             // copy the key (and the overlapping ones)
+                fl_copy_offscreen(X, Y, W, H, _layout, X - keyboard->x(), Y - keyboard->y());
+            draw_markers(i - 2 < _firstkey ? _firstkey : i - 2, i + 2 > _lastkey ? _lastkey : i + 2);
+            fl_pop_clip();
+        }
+    }
+    else {                                                  // copy only the visible part
+        fl_clip_box(keyboard->x(), keyboard->y(), keyboard->w(), keyboard->h(), X, Y, W, H);
+        if (W > 0 && H > 0)
+            fl_copy_offscreen(X, Y, W, H, _layout, X - keyboard->x(), Y - keyboard->y());
+        draw_markers(bk, _topkey);
+    }
+    fl_pop_clip();
+    memset(dirty_keys, 0, sizeof(dirty_keys));
+}
+
+
+void Fl_MIDIKeyboard::update_layout() {
+    int W = keyboard->w(), H = keyboard->h();
+    if (_layout_valid && W == _layout_w && H == _layout_h) return;
+    if (W != _layout_w || H != _layout_h) {
+        if (_layout)
+            fl_delete_offscreen(_layout);
+        _layout = fl_create_offscreen(W, H);
+        _layout_w = W;
+        _layout_h = H;
+    }
+    fl_begin_offscreen(_layout);
+    fl_color(FL_WHITE);                                     // the same as the keyboard box
+    fl_rectf(0, 0, W, H);
+    fl_color(FL_BLACK);
+    fl_rect(0, 0, W, H);
+    draw_keys(_firstkey, _lastkey, 0, 0);
+    fl_end_offscreen();
+    _layout_valid = true;
+}
+
+
+void Fl_MIDIKeyboard::damage_key(uchar k) {
+    dirty_keys[k] = true;
+    if (_frame_interval <= 0.0)                             // no coalescing
+        damage(FL_DAMAGE_USER1);
+    else
+        queue_frame();
+}
+
+
+void Fl_MIDIKeyboard::queue_frame() {
+    if (_frame_pending) {                                   // will be drawn with the others
+        _coalesced_frames++;
+        return;
+    }
+    _frame_pending = true;
+    if (_frame_queue.empty())                               // start the clock
+        Fl::add_timeout(_frame_interval, frame_clock_cb);
+    _frame_queue.push_back(this);
+}
+
+
+void Fl_MIDIKeyboard::frame_clock_cb(void*) {
+    std::vector<Fl_MIDIKeyboard*> ticking;                  // the listeners called by update_midi_in() can
+    ticking.swap(_frame_queue);                             // queue and unqueue (delete) widgets
+    std::vector<Fl_MIDIKeyboard*>* outer = _frame_ticking;
+    _frame_ticking = &ticking;
+    for (size_t i = 0; i < ticking.size(); i++) {
+        if (ticking[i] && ticking[i]->_in_pending)          // this marks the keys changed by the input
+            ticking[i]->update_midi_in();
+        if (!ticking[i]) continue;                          // unqueued by a listener
+        ticking[i]->_frame_pending = false;
+        ticking[i]->damage(FL_DAMAGE_USER1);
+    }
+    _frame_ticking = outer;                                 // the clock stops until the next change
+}
+
+
+void Fl_MIDIKeyboard::MIDIInChanged() {
+    _in_pending = true;
+    if (_frame_interval <= 0.0)
+        update_midi_in();
+    else
+        queue_frame();
+}
+
+
+void Fl_MIDIKeyboard::update_midi_in() {
+    _in_pending = false;
+    MKB_KeySet in = GetMIDIInKeys();
+    MKB_KeySet changed = _in_keys.diff(in);
+    if (changed.empty()) return;
+    MKB_KeySet keys = pressed_keys;
+    keys &= ~(changed & _in_keys);                          // the keys released on the input
+    keys |= changed & in;                                   // the keys pressed
+    _in_keys = in;
+    sync_pressed_status(keys, false);
+}
+
+
+void Fl_MIDIKeyboard::unqueue_frame() {
+    if (!_frame_pending) return;
+    for (size_t i = 0; i < _frame_queue.size(); i++) {
+        if (_frame_queue[i] == this) {
+            _frame_queue.erase(_frame_queue.begin() + i);
+            break;
+        }
+    }
+    if (_frame_ticking) {                                   // frame_clock_cb() must skip it
+        for (size_t i = 0; i < _frame_ticking->size(); i++)
+            if ((*_frame_ticking)[i] == this)
+                (*_frame_ticking)[i] = 0;
+    }
+    if (_frame_queue.empty())
+        Fl::remove_timeout(frame_clock_cb);
+    _frame_pending = false;
+}
+
+
+void Fl_MIDIKeyboard::frame_interval(double s) {
+    _frame_interval = s;
+    if (!_frame_queue.empty()) {                            // draw the pending changes
+        Fl::remove_timeout(frame_clock_cb);
+        frame_clock_cb(0);
+    }
+}
+
+
+void Fl_MIDIKeyboard::flush_redraw() {
+    if (_frame_pending) {
+        if (_in_pending)                                    // else the input would never be posted again
+            update_midi_in();
+        unqueue_frame();
+        damage(FL_DAMAGE_USER1);
+    }
+    Fl::flush();
+}
+
+
+void Fl_MIDIKeyboard::key_rect(uchar k, int& X, int& Y, int& W, int& H) {
+    int w = _geom.black[k] ? _geom.width[k] : _geom.width[k] + 1;  // with the line of the next key
+    int h = _geom.black[k] ? _b_height : _key_height;
+    if (_type == MKB_HORIZONTAL) {
+        X = keyboard->x() + _geom.offs[k];
+        Y = keyboard->y();
+        W = w;
+        H = h;
+    }
+    else {
+        X = keyboard->x();
+        Y = keyboard->y() + keyboard->h() - _geom.offs[k] - w;
+        W = h;
+        H = w;
+    }
+}
+
+
+void Fl_MIDIKeyboard::draw_keys(uchar from, uchar to, int X, int Y) {
+    fl_color(FL_BLACK);
+    if (_type == MKB_HORIZONTAL) {
+        int y_b_offs = Y + _b_height;
+        for (int i = from, cur_x = X + _geom.offs[from]; i <= to; i++, cur_x = X + _geom.offs[i]) {
+            if (_geom.black[i])
+                fl_rectf(cur_x, Y, _b_width, _b_height);
+            else
+                _geom.line[i] == KeyLayout::LINE_FULL ? fl_line(cur_x, Y, cur_x, Y + _key_height) :
+                                                        fl_line(cur_x, y_b_offs, cur_x, Y + _key_height);
+        }
+    }
+    else {
+        Y += _total_width;                                  // the keyboard bottom
+        int x_b_offs = X + _b_height;
+        for (int i = from, cur_y = Y - _geom.offs[from]; i <= to; i++, cur_y = Y - _geom.offs[i]) {
+            if (_geom.black[i])
+                fl_rectf(X, cur_y - _b_width, _b_height, _b_width);
+            else
+                _geom.line[i] == KeyLayout::LINE_FULL ? fl_line(X, cur_y, X + _key_height, cur_y) :
+                                                        fl_line(x_b_offs, cur_y, X + _key_height, cur_y);
+        }
+    }
+}
+
+
+void Fl_MIDIKeyboard::draw_markers(uchar from, uchar to) {
+    if (!_npressed) return;
+    if (from < _minpressed) from = _minpressed;             // only the range of the pressed keys
+    if (to > _maxpressed) to = _maxpressed;
     int X = keyboard->x(), Y = keyboard->y();
     int press_diam = _b_width-2;
     int press_w_h_offs = _b_height + (_key_height - _b_height - press_diam) / 2;
     int press_w_w_offs = (int)((_key_width-press_diam) / 2);
     int press_b_h_offs = _b_height - press_diam - 2;
-    uchar bk = is_black(_bottomkey) ? _bottomkey-1 : _bottomkey;    // need to begin with a white key
+    if (press_diam <= 0) return;
+    update_markers(press_diam);
 
-    fl_color(FL_BLACK);
     if (_type == MKB_HORIZONTAL) {
-        int y_b_offs = Y + _b_height;
-        for (int i = bk, cur_x = X + keyscoord[bk]; i <= _topkey; i++, cur_x = X + keyscoord[i]) {
-            if (is_black(i)) {
-                fl_rectf(cur_x, Y, _b_width, _b_height);
-                if (pressed_keys[i]) {
-                    fl_color(FL_RED);
-                    fl_pie(cur_x, Y + press_b_h_offs, press_diam, press_diam, 0, 360);
-                    fl_color(FL_BLACK);
-                }
-            }
-            else {
-                if (pressed_keys[i]) {
-                    fl_color(FL_RED);
-                    fl_pie(cur_x + press_w_w_offs, Y + press_w_h_offs, press_diam, press_diam, 0, 360);
-                    fl_color(FL_BLACK);
-                }
-                isCF(i) ? fl_line(cur_x, Y, cur_x, Y + _key_height) :
-                          fl_line(cur_x, y_b_offs, cur_x, Y + _key_height);
-
-            }
+        for (int i = pressed_keys.next(from); i != -1 && i <= to; i = pressed_keys.next(i + 1)) {
+            int cur_x = X + _geom.offs[i];
+            if (_geom.black[i])
+                _marker_b->draw(cur_x, Y + press_b_h_offs);
+            else
+                _marker_w->draw(cur_x + press_w_w_offs, Y + press_w_h_offs);
         }
     }
     else {
         Y += keyboard->h();
-        int x_b_offs = X + _b_height;
-        for (int i = bk, cur_y = Y - keyscoord[bk]; i <= _topkey; i++, cur_y = Y - keyscoord[i]) {
-            if (is_black(i)) {
-                fl_rectf(X, cur_y - _b_width, _b_height, _b_width);
-                if (pressed_keys[i]) {
-                    fl_color(FL_RED);
-                    fl_pie(X + press_b_h_offs, cur_y - press_diam,  press_diam, press_diam, 0, 360);
-                    fl_color(FL_BLACK);
-                }
-            }
-            else {
-                if (pressed_keys[i]) {
-                    fl_color(FL_RED);
-                    fl_pie(X + press_w_h_offs, cur_y - press_w_w_offs - press_diam, press_diam, press_diam, 0, 360);
-                    fl_color(FL_BLACK);
+        for (int i = pressed_keys.next(from); i != -1 && i <= to; i = pressed_keys.next(i + 1)) {
+            int cur_y = Y - _geom.offs[i];
+            if (_geom.black[i])
+                _marker_b->draw(X + press_b_h_offs, cur_y - press_diam);
+            else
+                _marker_w->draw(X + press_w_h_offs, cur_y - press_w_w_offs - press_diam);
+        }
+    }
+}
+
+
+void Fl_MIDIKeyboard::update_markers(int diam) {
+    if (diam == _marker_diam) return;
+    delete _marker_w;
+    delete _marker_b;
+    _marker_w = make_marker(diam, FL_RED, FL_WHITE);
+    _marker_b = make_marker(diam, FL_RED, FL_BLACK);
+    _marker_diam = diam;
+}
+
+
+Fl_RGB_Image* Fl_MIDIKeyboard::make_marker(int diam, Fl_Color fg, Fl_Color bg) {
+    uchar r1, g1, b1, r0, g0, b0;                           // foreground and background
+    Fl::get_color(fg, r1, g1, b1);
+    Fl::get_color(bg, r0, g0, b0);
+    uchar* data = new uchar[diam * diam * 3];
+    float rad = diam / 2.0f;
+    for (int y = 0; y < diam; y++) {
+        for (int x = 0; x < diam; x++) {
+            int cov = 0;                                    // 4x4 samples for each pixel
+            for (int sy = 0; sy < 4; sy++) {
+                float dy = y + (sy + 0.5f) / 4 - rad;
+                for (int sx = 0; sx < 4; sx++) {
+                    float dx = x + (sx + 0.5f) / 4 - rad;
+                    if (dx * dx + dy * dy <= rad * rad) cov++;
                 }
-                isCF(i) ? fl_line(X, cur_y, X + _key_height, cur_y) :
-                          fl_line(x_b_offs, cur_y, X + _key_height, cur_y);
             }
+            uchar* p = data + (y * diam + x) * 3;
+            p[0] = (uchar)((r1 * cov + r0 * (16 - cov)) / 16);
+            p[1] = (uchar)((g1 * cov + g0 * (16 - cov)) / 16);
+            p[2] = (uchar)((b1 * cov + b0 * (16 - cov)) / 16);
         }
     }
-    fl_pop_clip();
+    Fl_RGB_Image* img = new Fl_RGB_Image(data, diam, diam, 3);
+    img->alloc_array = 1;                                   // the image deletes the data
+    return img;
 }
 
 
@@ -10,12 +10,15 @@
 #include <cstring>		// memcpy
 #include <cctype>       // toupper, isnumber in name_to_number
 #include <cstdio>       // sprintf in number_to_note
+#include <vector>
 
 #include <FL/Fl.H>
 #include <FL/Fl_Group.H>
 #include <FL/Fl_Scroll.H>
 #include <FL/Fl_Box.H>
 #include <FL/Fl_draw.H>
+#include <FL/Fl_Image.H>
+#include <FL/x.H>           // Fl_Offscreen
 
 #if FL_MAJOR_VERSION == 1 && FL_MINOR_VERSION < 3
     #error Fl_MIDIKeyboard requires at least FLTK 1.3.x
@@ -23,6 +26,7 @@
 // due to a difference in the Fl_Scroll class, this is now incompatible with FLTK 1.1.x
 
 #include "MIDIDriver.h"
+#include "KeySet.h"
 
 
 #define MIDDLE_C 60                         ///< MIDI note number of middle C.
@@ -85,9 +89,34 @@ class Fl_MIDIKeyboard : public Fl_Scroll, public MKB_MIDIDriver
                 MKB_UNFOCUS = 0x200,        ///< the keyboard lost the focus
                 MKB_CLEAR = 0x400,          ///< the press status was cleared (all keys released)
                 MKB_PRESS = 0x800,          ///< a key was pressed. Call callback_note() to get its number
-                MKB_RELEASE = 0x1000        ///< a key was released. Call callback_note() to get its number
+                MKB_RELEASE = 0x1000,       ///< a key was released. Call callback_note() to get its number
+                MKB_SYNC = 0x2000,          ///< many keys were pressed and released together (by press_chord(),
+                                            ///< release_chord(), set_pressed_status() or sync_pressed_status()).
+                                            ///< Call changed_keys() to get them
+                MKB_ALL_EVENTS = 0x3f00     ///< all the above (for add_listener())
              };
 
+        /// How a listener receives the events (see add_listener()).
+        enum {  MKB_IMMEDIATE,              ///< every event is received as soon as it happens
+                MKB_BATCHED                 ///< the events are gathered and received together once per event loop turn
+             };
+
+        /// An event of the keyboard, as received by the listeners (see add_listener()).
+        /// The listeners receive the same events as the callback, except that a group of keys changed together
+        /// (by press_chord(), release_chord(), set_pressed_status() or sync_pressed_status()) gives a single
+        /// \ref MKB_SYNC event.
+        struct Event {
+            int         type;               ///< one of \ref MKB_FOCUS, \ref MKB_UNFOCUS, \ref MKB_CLEAR,
+                                            ///< \ref MKB_PRESS, \ref MKB_RELEASE, \ref MKB_SYNC. For the batched
+                                            ///< listeners all the events happened in the turn, ORed together
+            uchar       note;               ///< the key pressed or released (\ref MKB_PRESS and \ref MKB_RELEASE)
+            MKB_KeySet  pressed;            ///< the keys pressed
+            MKB_KeySet  released;           ///< the keys released
+        };
+
+        /// The type of the functions which listen to the keyboard events (see add_listener()).
+        typedef void (*Listener)(Fl_MIDIKeyboard* kb, const Event& e, void* p);
+
 
     private:
 
@@ -121,27 +150,81 @@ class Fl_MIDIKeyboard : public Fl_Scroll, public MKB_MIDIDriver
         uchar       _base_keyinput;         // base octave for computer keyboard input
         short       _callback_status;       // callback status
 
-        bool        pressed_keys[128];      // pressed keys
+        MKB_KeySet  pressed_keys;           // pressed keys
+        bool        dirty_keys[128];        // keys to repaint (see damage_key())
         bool        _autodrag;              // used for mouse scrolling
 
         uchar       _npressed;              // number of pressed keys
         uchar       _minpressed;            // minimum pressed key  (for speeding draw routine)
         uchar       _maxpressed;            // maximum pressed key
 
-        int         keyscoord[128];         // coords of the keys (used internally)
+        void        update_pressed();       // computes the three above from pressed_keys
+
+        MKB_KeySet  _changed_keys;          // keys changed by the last MKB_SYNC event
+
+        // The geometry of the keys, computed by set_keyboard_width() and used by the drawing and the
+        // hit testing routines. The arrays are indexed by MIDI note number, the vectors by pixel offset.
+        struct KeyLayout {
+            enum { LINE_NONE, LINE_SHORT, LINE_FULL };
+            int     offs[128];              // offset of the key from the keyboard begin
+            int     width[128];             // width of the key
+            bool    black[128];             // kind of the key
+            uchar   line[128];              // the line at the left of the key (LINE_NONE for black keys)
+            std::vector<uchar> at;          // the last key beginning at or before each offset
+            std::vector<uchar> bzone;       // the key at each offset, within the black keys height
+            std::vector<uchar> wzone;       // the key at each offset, below the black keys
+        };
+        KeyLayout   _geom;
 
         Fl_Box*     keyboard;				// keyboard box
 
+        Fl_Offscreen _layout;               // image of the whole keyboard without the pressed markers
+        int         _layout_w;              // its size (0 if not yet created)
+        int         _layout_h;
+        bool        _layout_valid;          // false if the image must be drawn again
+
+        Fl_RGB_Image* _marker_w;            // the pressed markers for white and black keys
+        Fl_RGB_Image* _marker_b;
+        int         _marker_diam;           // their diameter (0 if not yet created)
+
+        bool        _frame_pending;         // true if the widget is waiting for the frame clock
+        unsigned long _coalesced_frames;    // changes merged into an already pending frame
+        unsigned long _painted_frames;      // draw() calls
+
+        int         _update_level;          // nesting level of begin_update() / end_update()
+        bool        _update_pending;        // true if the layout must be computed at end_update()
+
+        struct ListenerEntry {              // a listener added by add_listener()
+            Listener    fn;                 // 0 if removed during a notify()
+            void*       p;
+            int         mask;
+            int         mode;
+        };
+        std::vector<ListenerEntry> _listeners;
+        int         _notifying;             // nesting level of notify() (the listeners can't be erased)
+        bool        _batch_pending;         // true if batch_cb() is scheduled
+        int         _batch_types;           // the events since the last batch_cb()
+        MKB_KeySet  _batch_start;           // the pressed keys before them
+        void        purge_listeners();      // erases the listeners removed during a notify()
+
+        bool        _in_pending;            // true if the MIDI input keys must be read at the next frame
+        MKB_KeySet  _in_keys;               // the MIDI input keys shown
+
+        static double _frame_interval;      // the frame clock interval (0 for no coalescing)
+        static std::vector<Fl_MIDIKeyboard*> _frame_queue;  // the widgets waiting for the frame clock
+        static std::vector<Fl_MIDIKeyboard*>* _frame_ticking;   // the widgets being damaged by the clock
+
 
 
     protected:
 
-        static const float DEFAULT_WH_RATIO = 0.2;          ///< default ratio between width and height for white keys
-        static const float DEFAULT_BW_HEIGHT_RATIO = 0.6;   ///< default black/white height ratio
-        static const float DEFAULT_BW_WIDTH_RATIO = 0.6;    ///< default black/white width ratio
-        static const int   DEFAULT_KW_RESIZE_MIN = 20;      ///< default min for resize_mode()
-        static const int   DEFAULT_KW_RESIZE_MAX = 20;      ///< default max for resize_mode()
-        static const int   DEFAULT_MIN_NUMBER_KEYS = 12;    ///< the minimum number of white keys (1 octave)
+        static constexpr float DEFAULT_WH_RATIO = 0.2;                ///< default ratio between width and height for white keys
+        static constexpr float DEFAULT_BW_HEIGHT_RATIO = 0.6;         ///< default black/white height ratio
+        static constexpr float DEFAULT_BW_WIDTH_RATIO = 0.6;          ///< default black/white width ratio
+        static constexpr int   DEFAULT_KW_RESIZE_MIN = 20;            ///< default min for resize_mode()
+        static constexpr int   DEFAULT_KW_RESIZE_MAX = 20;            ///< default max for resize_mode()
+        static constexpr int   DEFAULT_MIN_NUMBER_KEYS = 12;          ///< the minimum number of white keys (1 octave)
+        static constexpr double DEFAULT_FRAME_INTERVAL = 1.0 / 60;    ///< default for frame_interval()
 
         /// Returns the x coordinate of the visible top-left corner of the keyboard.
         short       kbdx()
@@ -183,8 +266,13 @@ class Fl_MIDIKeyboard : public Fl_Scroll, public MKB_MIDIDriver
 
         /// Returns the MIDI note number of the key at X, Y coordinates (relative to the window
         /// containing the widget). If no key corresponds to X, Y returns -1.
+        /// This is a lookup in the tables built by build_hit_tables().
         short       find_key(int X, int Y);
 
+        /// Builds the tables giving the key at every pixel offset from the keyboard begin (for the black keys
+        /// zone, for the zone below and regardless of the zone). Called by set_keyboard_width().
+        void        build_hit_tables();
+
         /// Sets the currently visible key range. This is called internally at every scrolling or resizing,
         /// and sets internal variables _bottomkey and _topkey).
         /// \see bottom_key(), top_key()
@@ -196,25 +284,99 @@ class Fl_MIDIKeyboard : public Fl_Scroll, public MKB_MIDIDriver
         /// Overrides FLTK method for vertical scrollbar.
         static void scrollbar_cb(Fl_Widget*, void*);
 
+        static constexpr bool BLACK_NOTES[12] =                     ///< the black keys in an octave
+            { false, true, false, true, false, false, true, false, true, false, true, false };
+        static constexpr bool CF_NOTES[12] =                        ///< the C and F keys in an octave
+            { true, false, false, false, false, true, false, false, false, false, false, false };
+        static constexpr uchar WHITES_BEFORE[12] =                  ///< the white keys before each note in an octave
+            { 0, 1, 1, 2, 2, 3, 4, 4, 5, 5, 6, 6 };
+
         /// Returns true if k is a black key.
-        static bool is_black(uchar note)  {
-            note %= 12;
-            return (note == 1 || note == 3 || note == 6 || note == 8 || note == 10); }
+        static bool is_black(uchar note)
+                        { return BLACK_NOTES[note % 12]; }
 
         /// Returns true if k is C or F.\ Used internally in draw() method.
-        static bool isCF(uchar note) {
-            note %= 12;
-            return (note == 0 || note == 5); }
+        static bool isCF(uchar note)
+                        { return CF_NOTES[note % 12]; }
+
+        /// Returns the number of white keys lower than the MIDI note number n.
+        static int  whites_below(int n)
+                        { return 7 * (n / 12) + WHITES_BEFORE[n % 12]; }
 
         /// The FLTK handle() method override.
         virtual int handle(int e);
 
-        /// The FLTK draw() method override.
+        /// The FLTK draw() method override. If only some keys were changed (see damage_key()) it repaints
+        /// only them, else the whole widget.
         virtual void draw(void);
 
+        /// Marks the key k as changed and damages the widget with FL_DAMAGE_USER1: the next draw() will repaint
+        /// only the changed keys (and the keys overlapping them) instead of the whole keyboard. Call this, instead
+        /// of redraw(), if you change the appearance of a single key. The damage is not given at once, but at
+        /// the next tick of the frame clock (see frame_interval()): only the repaint is delayed, as the
+        /// functions which press and release the keys send their MIDI messages before calling this.
+        void        damage_key(uchar k);
+
+        /// Called by the frame clock: damages all the widgets with changed keys.
+        static void frame_clock_cb(void*);
+
+        /// Adds the widget to the ones waiting for the frame clock.
+        void        queue_frame();
+
+        /// Removes the widget from the ones waiting for the frame clock.
+        void        unqueue_frame();
+
+        /// Presses and releases the keys which changed on the MIDI input port (see MKB_MIDIDriver::OpenMIDIInPort()),
+        /// without sending MIDI messages.
+        void        update_midi_in();
+
+        /// Sends the event to the immediate listeners and schedules batch_cb() for the batched ones.
+        /// Call it after changing the pressed keys.
+        void        notify(int type, uchar note, const MKB_KeySet& pressed, const MKB_KeySet& released);
+
+        /// Called at the next event loop turn: sends the gathered events to the batched listeners.
+        static void batch_cb(void*);
+
+        /// Draws the keys from *from* to *to* (MIDI note numbers), without the pressed markers, over the
+        /// keyboard background. X, Y are the coordinates of the top-left corner of the whole keyboard.
+        /// It doesn't set the clip region.
+        void        draw_keys(uchar from, uchar to, int X, int Y);
+
+        /// Draws the markers of the pressed keys from *from* to *to*.
+        void        draw_markers(uchar from, uchar to);
+
+        /// The pressed markers are antialiased circles drawn once in two images (on the white and on the black
+        /// background), so every marker is a single image copy. This creates them again if their diameter
+        /// has changed.
+        void        update_markers(int diam);
+
+        /// Returns a new antialiased circle image with the given diameter and colors.
+        static Fl_RGB_Image* make_marker(int diam, Fl_Color fg, Fl_Color bg);
+
+        /// The static look of the keyboard is drawn once in an offscreen image, and draw() only copies it on
+        /// the screen and adds the pressed markers. This makes the image to be drawn again at the next
+        /// draw(): the functions which change the keys size or range call it.
+        void        invalidate_layout()
+                            { _layout_valid = false; }
+
+        /// Draws the offscreen image of the keyboard, if it is not valid.
+        void        update_layout();
+
+        /// Gets the rectangle occupied by the key k (in window coordinates).
+        void        key_rect(uchar k, int& X, int& Y, int& W, int& H);
+
         /// Used internally for mouse scrolling
         static void autodrag_to( void* p);
 
+        /// The MKB_MIDIDriver override: the driver events are delivered to the FLTK thread by Fl::awake().
+        /// Remember to call Fl::lock() in your main() if the widget must receive them.
+        virtual void PostToMainThread(void (*fn)(void*), void* p)
+                            { Fl::awake(fn, p); }
+
+        /// Redefinition of the MKB_MIDIDriver function: the input keys are read and shown at the next tick of
+        /// the frame clock (see frame_interval()).
+        virtual void MIDIInChanged();
+
     public:
 
         /// Returns the number of white keys between given MIDI note numbers (including first and last).
@@ -240,8 +402,50 @@ class Fl_MIDIKeyboard : public Fl_Scroll, public MKB_MIDIDriver
         /// \see resize_mode(), set_range(), scroll_mode(), press_mode()
         Fl_MIDIKeyboard(int X, int Y, int W, int H, const char *l=0);
 
+        /// This constructor also sets the mode of the MKB_MIDIDriver. With MKB_MIDIDriver::DISPLAY_ONLY the
+        /// keyboard never opens a MIDI client, and can only be used for showing notes.
+        /// \par X,Y,W,H,l	as usual in FLTK
+        /// \par mode the driver mode
+        Fl_MIDIKeyboard(int X, int Y, int W, int H, DriverMode mode, const char *l=0);
+
         /// The destructor.
-        virtual     ~Fl_MIDIKeyboard() {}
+        virtual     ~Fl_MIDIKeyboard();
+
+        /// Sets the interval (in seconds) of the frame clock. The key changes (pressed and released keys) are
+        /// not drawn at once, but gathered and drawn together at the next tick of a clock shared by all the
+        /// keyboards, so a burst of MIDI events causes at most one repaint per interval. The default is
+        /// \ref DEFAULT_FRAME_INTERVAL (60 frames per second); 0 repaints the keys at every change.
+        static void frame_interval(double s);
+
+        /// Returns the interval of the frame clock.
+        static double frame_interval()
+                        { return _frame_interval; }
+
+        /// Repaints now the changed keys, without waiting for the frame clock (it calls Fl::flush()).
+        void        flush_redraw();
+
+        /// Returns the number of key changes which were merged into an already scheduled repaint.
+        unsigned long coalesced_frames() const
+                        { return _coalesced_frames; }
+
+        /// Returns the number of times the widget was painted.
+        unsigned long painted_frames() const
+                        { return _painted_frames; }
+
+        /// Sets to 0 the coalesced_frames() and painted_frames() counters.
+        void        reset_frame_counters()
+                        { _coalesced_frames = _painted_frames = 0; }
+
+        /// Starts a group of configuration changes. Until the matching end_update() the calls to
+        /// set_range(), key_width(), bw_width_ratio(), resize_mode() and scroll_mode() only store their values,
+        /// and the keyboard layout, the scrollbars and the visible keys are computed once at end_update().
+        /// The calls can be nested (only the outer end_update() computes the layout).
+        /// \note Call center_keyboard() or key_position() after end_update(), because they need the new layout.
+        void        begin_update()
+                        { _update_level++; }
+
+        /// Ends a group of configuration changes started by begin_update(), computing the new layout.
+        void        end_update();
 
         /// Gets the horizontal/vertical placement of the keyboard.
         /// It depends from the keyboard width/height and cannot be changed.
@@ -388,24 +592,51 @@ class Fl_MIDIKeyboard : public Fl_Scroll, public MKB_MIDIDriver
 
         /// Returns true if key k is pressed. k is the MIDI note number of the key.
         bool        is_pressed(uchar k) const
-                        { return pressed_keys[k]; }
+                        { return pressed_keys.test(k); }
 
         /// Same, but k is a string identifying the note.
         /// \see note_to_number(), number_to_note()
         bool        is_pressed(const char* k) const
-                        { return pressed_keys[note_to_number(k)]; }
+                        { return pressed_keys.test(note_to_number(k)); }
 
         /// Sets the pressed status. The keyboard holds internally an array of 128 bool for tracking which keys
         /// are pressed or released. This loads the array with an user supplied status and sets other internal variables.
         /// \param[in] keys_array an array of 128 bool holding the status (pressed/released) for every key
-        void        set_pressed_status(bool* keys_array);
+        void        set_pressed_status(const bool* keys_array);
+
+        /// Same, but the status is given as a set of the pressed keys. Only the keys which changed are redrawn.
+        /// \param[in] keys the pressed keys
+        void        set_pressed_status(const MKB_KeySet& keys);
 
         /// Returns all variables related to the pressed keys status.
         /// \param[out]	keys_array an array of 128 bool getting the status (pressed/released) for every key
         /// \param[out]	n the number of pressed keys
         /// \param[out] min,max	the lower an upper key preessed MIDI note number
         /// \see set_pressed_status()
-        void        get_pressed_status(const bool* keys_array, uchar& n, uchar& min, uchar& max);
+        void        get_pressed_status(bool* keys_array, uchar& n, uchar& min, uchar& max) const;
+
+        /// Returns the set of the pressed keys.
+        const MKB_KeySet& get_pressed_status() const
+                        { return pressed_keys; }
+
+        /// Brings the pressed status to the given one, as if the keys which changed were pressed or released.
+        /// Unlike set_pressed_status() this can also send the MIDI messages: the note off for the released keys
+        /// and then the note on for the pressed ones, as a single group (see SendMIDIMessages()). Only the
+        /// changed keys are redrawn, and the callback is done once with the \ref MKB_SYNC status (if when()
+        /// contains \ref MKB_WHEN_PRESS and some key was pressed, or \ref MKB_WHEN_RELEASE and some key was
+        /// released).
+        /// \param[in] keys the new pressed keys
+        /// \param[in] send_midi if false no MIDI message is sent
+        void        sync_pressed_status(const MKB_KeySet& keys, bool send_midi = true);
+
+        /// Same, but the new status is given as an array of 128 bool.
+        void        sync_pressed_status(const bool* keys_array, bool send_midi = true);
+
+        /// Returns the keys changed by the last \ref MKB_SYNC event, i.e.\ by the last press_chord(),
+        /// release_chord(), set_pressed_status() or sync_pressed_status() (you can call it in the callback or
+        /// in a listener).
+        const MKB_KeySet& changed_keys() const
+                        { return _changed_keys; }
 
         /// Sets all keys as released.
         void        clear_pressed_status();
@@ -419,11 +650,37 @@ class Fl_MIDIKeyboard : public Fl_Scroll, public MKB_MIDIDriver
         /// If k is not a pressed key this does nothing, else it sends a MIDI note off message to the open port.
         void        release_key(uchar k);
 
+        /// Press together all the keys in the array (an array of MIDI note numbers).
+        /// This is the same as calling press_key() for each of them, but the MIDI note on messages are sent
+        /// to the open port as a single group (see SendMIDIMessages()) and the widget is redrawn once.
+        /// \param keys the keys to press
+        /// \param n the number of keys in the array
+        void        press_chord(const uchar* keys, uchar n);
+
+        /// Release together all the keys in the array, sending the MIDI note off messages as a single group.
+        /// Keys which are not pressed are ignored.
+        void        release_chord(const uchar* keys, uchar n);
+
         /// Returns the condition that generated the callback.
         /// \return one of \ref MKB_FOCUS, \ref MKB_UNFOCUS, \ref MKB_CLEAR, \ref MKB_PRESS, \ref MKB_RELEASE
         int         callback_status() const
                         { return _callback_status & 0xff00; }
 
+        /// Adds a listener, a function which is called when the keyboard events happen. Unlike the callback,
+        /// there can be many listeners and each one can choose the events it receives. A batched listener is
+        /// called once per event loop turn, with the net change of the pressed keys since the previous call
+        /// (a key pressed and released in the same turn doesn't appear), so it costs nothing for key floods.
+        /// The when() setting doesn't affect the listeners.
+        /// \param fn the listener
+        /// \param p a pointer passed to the listener
+        /// \param mask the events to receive (\ref MKB_FOCUS, \ref MKB_PRESS, ... ORed together)
+        /// \param mode \ref MKB_IMMEDIATE or \ref MKB_BATCHED
+        void        add_listener(Listener fn, void* p, int mask = MKB_ALL_EVENTS, int mode = MKB_IMMEDIATE);
+
+        /// Removes a listener added with add_listener() (fn and p must be the same). It can be called by a
+        /// listener.
+        void        remove_listener(Listener fn, void* p);
+
         /// Returns the note (pressed or released) that generated the callback.
         uchar       callback_note()
                         { return _callback_status & 0xff; }
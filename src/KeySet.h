@@ -0,0 +1,190 @@
+#ifndef KEYSET_H_INCLUDED
+#define KEYSET_H_INCLUDED
+
+/// \file
+/// This file contains the MKB_KeySet class, a set of MIDI note numbers.
+
+#include <cstdint>
+
+
+/// The class MKB_KeySet is a set of MIDI note numbers (0 ... 127), stored as a 128 bit mask in two 64 bit words.
+/// Fl_MIDIKeyboard uses it for the pressed keys: counting the keys and finding the lower and upper one are
+/// done with a few bit operations (population count, count of trailing and leading zeros) instead of scanning
+/// an array, and whole sets can be joined, intersected and compared at once.
+/// Note numbers greater than 127 must not be passed to the functions.
+class MKB_KeySet {
+    public:
+
+        /// The constructor creates an empty set.
+                            MKB_KeySet()            { bits[0] = bits[1] = 0; }
+
+        /// Creates the set from its two 64 bit words (see word()).
+                            MKB_KeySet(uint64_t w0, uint64_t w1)
+                                { bits[0] = w0; bits[1] = w1; }
+
+        /// Creates the set from an array of 128 bool (the key k is in the set if keys[k] is true).
+        explicit            MKB_KeySet(const bool* keys)
+                                { from_array(keys); }
+
+        /// Returns true if the key k is in the set.
+        bool                test(unsigned k) const
+                                { return (bits[k >> 6] >> (k & 63)) & 1; }
+
+        /// Adds the key k to the set.
+        void                set(unsigned k)         { bits[k >> 6] |= (uint64_t)1 << (k & 63); }
+
+        /// Removes the key k from the set.
+        void                reset(unsigned k)       { bits[k >> 6] &= ~((uint64_t)1 << (k & 63)); }
+
+        /// Adds all the keys from *from* to *to* (included) to the set.
+        void                set_range(unsigned from, unsigned to);
+
+        /// Removes all the keys from the set.
+        void                clear()                 { bits[0] = bits[1] = 0; }
+
+        /// Returns true if the set is empty.
+        bool                empty() const           { return (bits[0] | bits[1]) == 0; }
+
+        /// Returns the number of keys in the set.
+        int                 count() const           { return popcount(bits[0]) + popcount(bits[1]); }
+
+        /// Returns the lower key of the set, or -1 if the set is empty.
+        int                 min() const
+                                { return bits[0] ? ctz(bits[0]) : bits[1] ? 64 + ctz(bits[1]) : -1; }
+
+        /// Returns the upper key of the set, or -1 if the set is empty.
+        int                 max() const
+                                { return bits[1] ? 127 - clz(bits[1]) : bits[0] ? 63 - clz(bits[0]) : -1; }
+
+        /// Returns the lower key of the set which is greater or equal than k, or -1 if there is none.
+        /// You can iterate over the set with
+        /// \code for (int k = set.next(0); k != -1; k = set.next(k + 1)) \endcode
+        int                 next(unsigned k) const;
+
+        /// Returns the keys which are in only one of the two sets (i.e.\ the keys which changed their status).
+        MKB_KeySet          diff(const MKB_KeySet& s) const
+                                { return *this ^ s; }
+
+        /// Copies the set into an array of 128 bool.
+        void                to_array(bool* keys) const;
+
+        /// Loads the set from an array of 128 bool.
+        void                from_array(const bool* keys);
+
+        /// Returns one of the two 64 bit words of the set (0 for the keys 0 ... 63, 1 for the keys 64 ... 127).
+        uint64_t            word(int i) const       { return bits[i]; }
+
+        MKB_KeySet&         operator|=(const MKB_KeySet& s)
+                                { bits[0] |= s.bits[0]; bits[1] |= s.bits[1]; return *this; }
+        MKB_KeySet&         operator&=(const MKB_KeySet& s)
+                                { bits[0] &= s.bits[0]; bits[1] &= s.bits[1]; return *this; }
+        MKB_KeySet&         operator^=(const MKB_KeySet& s)
+                                { bits[0] ^= s.bits[0]; bits[1] ^= s.bits[1]; return *this; }
+        MKB_KeySet          operator|(const MKB_KeySet& s) const
+                                { MKB_KeySet r(*this); return r |= s; }
+        MKB_KeySet          operator&(const MKB_KeySet& s) const
+                                { MKB_KeySet r(*this); return r &= s; }
+        MKB_KeySet          operator^(const MKB_KeySet& s) const
+                                { MKB_KeySet r(*this); return r ^= s; }
+        MKB_KeySet          operator~() const
+                                { MKB_KeySet r; r.bits[0] = ~bits[0]; r.bits[1] = ~bits[1]; return r; }
+        bool                operator==(const MKB_KeySet& s) const
+                                { return bits[0] == s.bits[0] && bits[1] == s.bits[1]; }
+        bool                operator!=(const MKB_KeySet& s) const
+                                { return !(*this == s); }
+
+    private:
+
+        // The bit operations on a non zero word. The compiler builtins become a single instruction on most
+        // CPUs; the others are the usual portable versions.
+        static int          popcount(uint64_t w);
+        static int          ctz(uint64_t w);
+        static int          clz(uint64_t w);
+
+        uint64_t            bits[2];            // bits[0] holds the keys 0 ... 63, bits[1] the keys 64 ... 127
+};
+
+
+inline void MKB_KeySet::set_range(unsigned from, unsigned to) {
+    for (int i = 0; i < 2; i++) {
+        unsigned lo = i * 64, hi = lo + 63;
+        if (from > hi || to < lo) continue;
+        unsigned f = from > lo ? from - lo : 0;
+        unsigned t = to < hi ? to - lo : 63;
+        uint64_t mask = (t == 63 ? ~(uint64_t)0 : ((uint64_t)1 << (t + 1)) - 1);
+        bits[i] |= mask & ~(((uint64_t)1 << f) - 1);
+    }
+}
+
+
+inline int MKB_KeySet::next(unsigned k) const {
+    if (k < 64) {
+        uint64_t w = bits[0] & (~(uint64_t)0 << k);
+        if (w)
+            return ctz(w);
+        k = 64;
+    }
+    if (k < 128) {
+        uint64_t w = bits[1] & (~(uint64_t)0 << (k - 64));
+        if (w)
+            return 64 + ctz(w);
+    }
+    return -1;
+}
+
+
+inline void MKB_KeySet::to_array(bool* keys) const {
+    for (int i = 0; i < 128; i++)
+        keys[i] = test(i);
+}
+
+
+inline void MKB_KeySet::from_array(const bool* keys) {
+    bits[0] = bits[1] = 0;
+    for (int i = 0; i < 128; i++)
+        if (keys[i])
+            bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+
+inline int MKB_KeySet::popcount(uint64_t w) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(w);
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((w * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+
+inline int MKB_KeySet::ctz(uint64_t w) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(w);
+#else
+    int n = 0;
+    while (!(w & 1)) {
+        w >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+
+inline int MKB_KeySet::clz(uint64_t w) {
+#if defined(__GNUC__)
+    return __builtin_clzll(w);
+#else
+    int n = 0;
+    while (!(w & 0x8000000000000000ULL)) {
+        w <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+
+#endif // KEYSET_H_INCLUDED
@@ -1,65 +1,943 @@
 #include "MIDIDriver.h"
+#include <chrono>
+#include <cstring>
 
 
 
 
-MKB_MIDIDriver::MKB_MIDIDriver() :
+std::map<uintptr_t, MKB_MIDIDriver*> MKB_MIDIDriver::live_drivers;
+uintptr_t MKB_MIDIDriver::last_live_id = 0;
+std::mutex MKB_MIDIDriver::live_mutex;
+std::map<std::string, MKB_MIDIDriver::PortState> MKB_MIDIDriver::port_states;
+MKB_MIDIDriver::PortState MKB_MIDIDriver::closed_state;
+std::vector<std::string> MKB_MIDIDriver::stale_states;
+std::atomic<bool> MKB_MIDIDriver::states_stale(false);
+std::map<MKB_MIDIDriver::ConnKey, MKB_MIDIDriver::Connection*> MKB_MIDIDriver::connections;
+RtMidiOut* MKB_MIDIDriver::ports_out = 0;
+int MKB_MIDIDriver::ports_users = 0;
+std::vector<std::shared_ptr<MKB_MIDIDriver::OpenJob>> MKB_MIDIDriver::open_jobs;
+std::mutex MKB_MIDIDriver::pool_mutex;
+
+
+MKB_MIDIDriver::MKB_MIDIDriver(DriverMode m) :
     out_open(false), port(0), channel(0), program(0),
-    volume(100), pan(64), note_vel(100) {
+    volume(100), pan(64), note_vel(100), async_queue(0),
+    async_sleeping(false), async_running(false), async_overflows(0),
+    active_state(0), devs_changed(true), devs_posted(false),
+    devs_callback(0), devs_callback_data(0), posted_any(false), conn(0), mode(m), ports_acquired(false),
+    opening(false), open_again(false), open_port(0), open_callback(0),
+    open_callback_data(0), pending_policy(PENDING_BUFFER), midi_in(0), in_open(false), in_pedal(false),
+    in_sustain(false), in_posted(false) {
 
-    midi_out = new RtMidiOut;
+    in_keys[0] = in_keys[1] = 0;
+
+    std::lock_guard<std::mutex> lock(live_mutex);
+    live_id = ++last_live_id;
+    live_drivers[live_id] = this;                           // the backend is initialized later
 }
 
 
 MKB_MIDIDriver::~MKB_MIDIDriver() {
+    StopNotifications();                                    // if not yet done by the derived class
+    delete midi_in;                                         // stops the input thread
+    StopAsyncOutput();
     CloseMIDIOutPort();
-    delete midi_out;
+
+    if ( !ports_acquired ) return;
+    RtMidiOut* out = 0;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if ( --ports_users == 0 ) {                         // the last driver
+            ports_out->setPortChangeCallback(0, 0);
+            out = ports_out;
+            ports_out = 0;
+        }
+    }
+    if ( out )                                              // all the opens have been abandoned: wait for
+        JoinOpenThreads(true);                              // them to release their connections
+    delete out;                                             // out of the lock: this joins the monitor thread,
+}                                                           // which could be waiting for it
+
+
+int MKB_MIDIDriver::GetNumMIDIOutDevs() {
+    UpdateDevs();
+    return devs.size();
+}
+
+
+const char* MKB_MIDIDriver::GetMIDIOutDevName(unsigned int id) {
+    UpdateDevs();
+    return id < devs.size() ? devs[id].name.c_str() : "";
+}
+
+
+const char* MKB_MIDIDriver::GetMIDIOutDevUID(unsigned int id) {
+    UpdateDevs();
+    return id < devs.size() ? devs[id].id.c_str() : "";
+}
+
+
+int MKB_MIDIDriver::FindMIDIOutDev(const char* uid) {
+    UpdateDevs();
+    for (size_t i = 0; i < devs.size(); i++)
+        if (devs[i].id == uid)
+            return i;
+    return -1;
+}
+
+
+void MKB_MIDIDriver::RefreshMIDIOutDevs() {
+    if ( !AcquirePorts() ) return;
+    std::string uid = port < devs.size() ? devs[port].id : std::string();
+    devs_changed = false;                                   // a change from now on will be seen next time
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);       // another thread could be opening a port
+        ports_out->getPortList(devs);
+    }
+    for (std::map<std::string, PortState>::iterator it = port_states.begin(); it != port_states.end(); ++it) {
+        size_t i = 0;                                       // forget the state of the ports which have gone:
+        while (i < devs.size() && devs[i].id != it->first)  // the device could be plugged again
+            i++;
+        if (i == devs.size())
+            it->second.Clear();
+    }
+    if (uid.empty()) return;
+    for (size_t i = 0; i < devs.size(); i++) {              // follow the active port
+        if (devs[i].id == uid) {
+            port = i;
+            return;
+        }
+    }
+}
+
+
+bool MKB_MIDIDriver::AcquirePorts() {
+    if ( mode == DISPLAY_ONLY ) return false;
+    if ( ports_acquired ) return true;
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if ( ports_users == 0 ) {                               // the first driver
+        ports_out = new RtMidiOut;
+        ports_out->setPortChangeCallback(PortsChangedCB, 0);
+    }
+    ports_users++;
+    ports_acquired = true;
+    return true;
+}
+
+
+void MKB_MIDIDriver::PortsChangedCB(void* p) {
+    std::lock_guard<std::mutex> lock(live_mutex);
+    for (std::map<uintptr_t, MKB_MIDIDriver*>::iterator it = live_drivers.begin(); it != live_drivers.end(); ++it) {
+        MKB_MIDIDriver* d = it->second;
+        if ( d->mode == DISPLAY_ONLY ) continue;
+        d->devs_changed = true;
+        if ( !d->devs_posted.exchange(true) )               // a single call for a group of changes
+            d->PostToMainThread(DevsChangedMainCB, d->LiveToken());
+    }
+}
+
+
+void MKB_MIDIDriver::DevsChangedMainCB(void* p) {
+    MKB_MIDIDriver* d = FindLive(p);
+    if ( !d ) return;
+    d->devs_posted = false;
+    d->UpdateDevs();
+    if (d->devs_callback)
+        d->devs_callback(d, d->devs_callback_data);
+}
+
+
+int MKB_MIDIDriver::GetNumMIDIInDevs() {
+    RefreshMIDIInDevs();
+    return in_devs.size();
+}
+
+
+const char* MKB_MIDIDriver::GetMIDIInDevName(unsigned int id) {
+    if ( in_devs.empty() )                                  // not yet enumerated
+        RefreshMIDIInDevs();
+    return id < in_devs.size() ? in_devs[id].c_str() : "";
+}
+
+
+void MKB_MIDIDriver::RefreshMIDIInDevs() {
+    in_devs.clear();
+    if ( !AcquireInput() ) return;
+    unsigned int n = midi_in->getPortCount();
+    for ( unsigned int i = 0; i < n; i++ )
+        in_devs.push_back(midi_in->getPortName(i));
+}
+
+
+bool MKB_MIDIDriver::AcquireInput() {
+    if ( mode == DISPLAY_ONLY ) return false;
+    if ( !midi_in ) {
+        midi_in = new RtMidiIn;
+        midi_in->ignoreTypes(true, true, true);             // only channel messages
+    }
+    return true;
+}
+
+
+void MKB_MIDIDriver::OpenMIDIInPort(unsigned int id) {
+    CloseMIDIInPort();
+    if ( !AcquireInput() ) return;
+    in_held.clear();                                        // the input thread is not running
+    in_sustained.clear();
+    in_pedal = false;
+    midi_in->setBatchCallback(InputBatchCB, this);
+    try {
+        midi_in->openPort(id);
+    }
+    catch (RtError&) {
+        midi_in->cancelCallback();                          // else the next open could not set it
+        throw;
+    }
+    in_open = true;
+}
+
+
+void MKB_MIDIDriver::CloseMIDIInPort() {
+    CloseInput(true);
+}
+
+
+void MKB_MIDIDriver::CloseInput(bool notify) {
+    if ( !in_open ) return;
+    midi_in->closePort();
+    midi_in->cancelCallback();
+    in_open = false;
+    if ( in_keys[0] | in_keys[1] ) {                        // release the input keys
+        in_keys[0] = in_keys[1] = 0;
+        if ( notify )
+            MIDIInChanged();
+    }
+}
+
+
+MKB_KeySet MKB_MIDIDriver::GetMIDIInKeys() {
+    in_posted = false;                                      // before reading: a later change posts again
+    return MKB_KeySet(in_keys[0].load(), in_keys[1].load());
+}
+
+
+void MKB_MIDIDriver::InputBatchCB(const RtMidiIn::BatchMessage* msgs, unsigned int count, void* p) {
+    MKB_MIDIDriver* d = (MKB_MIDIDriver*)p;
+    for (unsigned int i = 0; i < count; i++)
+        d->ApplyInput(msgs[i].bytes, msgs[i].size);
+    d->PublishInput();                                      // does nothing if the keys didn't change
+}
+
+
+void MKB_MIDIDriver::ApplyInput(const unsigned char* msg, unsigned int size) {
+    if ( size < 3 ) return;
+    unsigned char status = msg[0] & 0xf0, data1 = msg[1] & 0x7f, data2 = msg[2];
+    bool sustain = in_sustain;
+
+    if ( status == NOTE_ON && data2 > 0 ) {
+        in_held.set(data1);
+        in_sustained.reset(data1);
+    }
+    else if ( status == NOTE_OFF || status == NOTE_ON ) {   // note on with velocity 0 is a note off
+        in_held.reset(data1);
+        if ( sustain && in_pedal )
+            in_sustained.set(data1);
+    }
+    else if ( status == CONTROL_CHANGE ) {
+        if ( data1 == C_DAMPER ) {
+            in_pedal = data2 >= 64;
+            if ( !in_pedal )
+                in_sustained.clear();
+        }
+        else if ( data1 >= C_ALL_SOUND_OFF && data1 != C_RESET && data1 != C_LOCAL ) {   // all notes off
+            in_held.clear();
+            in_sustained.clear();
+        }
+    }
+}
+
+
+void MKB_MIDIDriver::PublishInput() {
+    MKB_KeySet keys = in_held | in_sustained;
+    uint64_t w0 = keys.word(0), w1 = keys.word(1);
+    if ( w0 == in_keys[0].load(std::memory_order_relaxed) && w1 == in_keys[1].load(std::memory_order_relaxed) )
+        return;                                             // nothing changed
+    in_keys[0] = w0;
+    in_keys[1] = w1;
+    if ( !in_posted.exchange(true) )                        // a single call until the keys are read
+        PostToMainThread(InputMainCB, LiveToken());
+}
+
+
+void MKB_MIDIDriver::InputMainCB(void* p) {
+    MKB_MIDIDriver* d = FindLive(p);
+    if ( !d ) return;
+    d->MIDIInChanged();
+}
+
+
+MKB_MIDIDriver* MKB_MIDIDriver::FindLive(void* token) {
+    std::lock_guard<std::mutex> lock(live_mutex);
+    std::map<uintptr_t, MKB_MIDIDriver*>::iterator it = live_drivers.find((uintptr_t)token);
+    return it != live_drivers.end() ? it->second : 0;
+}
+
+
+void MKB_MIDIDriver::StopNotifications() {
+    {
+        std::lock_guard<std::mutex> lock(live_mutex);       // PortsChangedCB() holds it while posting
+        live_drivers.erase(live_id);
+    }
+    AbandonOpen(false);                                     // its thread posts only if not abandoned
+    CloseInput(false);                                      // waits for the input callback; the object
+}                                                           // is being destroyed, so don't notify it
+
+
+void MKB_MIDIDriver::PostToMainThread(void (*fn)(void*), void* p) {
+    PostedCall call = { fn, p };
+    std::lock_guard<std::mutex> lock(posted_mutex);
+    posted_calls.push_back(call);
+    posted_any.store(true, std::memory_order_release);
+}
+
+
+void MKB_MIDIDriver::RunPostedCalls() {
+    std::vector<PostedCall> calls;
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex);
+        calls.swap(posted_calls);                           // the calls can post again
+        posted_any.store(false, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < calls.size(); i++)
+        calls[i].fn(calls[i].p);
 }
 
 
 void MKB_MIDIDriver::OpenMIDIOutPort () {
+    WaitOpen();
+    if ( !AcquirePorts() ) return;                      // display only
     if ( !out_open ) {
-
-        midi_out->openPort(port);
-        out_open=true;
-        SetProgram(program);
-        SetVolume(volume);
-        SetPan(pan);
+        UpdateDevs();                                   // RtMidi numbers the current ports
+        Connection* c = AcquireConnection(PortKey(port), port);
+        {
+            std::lock_guard<std::mutex> lock(out_mutex);
+            conn = c;
+            out_open=true;
+        }
+        active_state = &port_states[c->uid];
+        SendSettings();
     }
 }
 
 
 void MKB_MIDIDriver::CloseMIDIOutPort() {
+    AbandonOpen(true);                                      // don't wait for a background open
     if ( out_open ) {
-        midi_out->closePort();
-        out_open=false;
+        FlushAsyncOutput();                                 // don't lose the queued messages (note offs!)
+        Connection* c = conn;
+        {
+            std::lock_guard<std::mutex> lock(out_mutex);
+            conn = 0;
+            out_open=false;
+        }
+        active_state = 0;
+        ReleaseConnection(c);
+    }
+}
+
+
+MKB_MIDIDriver::Connection* MKB_MIDIDriver::AcquireConnection(const ConnKey& key, unsigned int id) {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    std::map<ConnKey, Connection*>::iterator it = connections.find(key);
+    if ( it != connections.end() ) {                        // already opened by another driver
+        it->second->users++;
+        return it->second;
+    }
+    lock.unlock();                                          // opening can be slow: don't block the others
+    RtMidiOut* out = new RtMidiOut;
+    try {
+        std::vector<RtMidiOut::PortInfo> list;              // the number could refer to another port now
+        out->getPortList(list);
+        if ( id >= list.size() || list[id].id != key.second ) {
+            id = 0;
+            while ( id < list.size() && list[id].id != key.second )
+                id++;
+            if ( id == list.size() )
+                RtMidi::error(RtError::INVALID_DEVICE, "MKB_MIDIDriver: port " + key.second + " not found");
+        }
+        out->openPort(id);
+    }
+    catch (RtError&) {
+        delete out;
+        throw;
+    }
+    lock.lock();
+    it = connections.find(key);
+    if ( it != connections.end() ) {                        // another thread has opened it in the meanwhile
+        it->second->users++;
+        lock.unlock();
+        delete out;
+        return it->second;
+    }
+    Connection* c = new Connection;
+    c->out = out;
+    c->users = 1;
+    c->uid = key.second;
+    connections[key] = c;
+    return c;
+}
+
+
+void MKB_MIDIDriver::ReleaseConnection(Connection* c) {
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if ( --c->users > 0 ) return;
+        for (std::map<ConnKey, Connection*>::iterator it = connections.begin(); it != connections.end(); ++it) {
+            if ( it->second == c ) {
+                stale_states.push_back(it->first.second);   // the device state is unknown when reopened
+                states_stale = true;
+                connections.erase(it);
+                break;
+            }
+        }
+    }
+    delete c->out;                                          // this closes the port (out of the lock, as it
+    delete c;                                               // can be slow)
+}
+
+
+void MKB_MIDIDriver::OpenMIDIOutPortAsync(OpenCallback cb, void* p) {
+    if ( opening ) {
+        open_callback = cb;                                 // replaces the previous callback
+        open_callback_data = p;
+        open_again = (port != open_port);
+        return;
+    }
+    if ( out_open || !AcquirePorts() ) {
+        if (cb)
+            cb(this, out_open, p);
+        return;
+    }
+    open_callback = cb;
+    open_callback_data = p;
+    StartOpen(0);
+}
+
+
+void MKB_MIDIDriver::SetActivePortAsync(unsigned int id, OpenCallback cb, void* p) {
+    if ( opening ) {                                        // the new port will be opened at the end
+        port = id;
+        OpenMIDIOutPortAsync(cb, p);
+        return;
+    }
+    Connection* old = conn;
+    if ( old ) {                                            // stop sending to the old port
+        FlushAsyncOutput();
+        std::lock_guard<std::mutex> lock(out_mutex);
+        conn = 0;
+        out_open = false;
+        active_state = 0;
+    }
+    port = id;
+    if ( old ) {
+        open_callback = cb;
+        open_callback_data = p;
+        StartOpen(old);
+    }
+    else if (cb)                                            // no port to switch
+        cb(this, false, p);
+}
+
+
+void MKB_MIDIDriver::StartOpen(Connection* old) {
+    JoinOpenThreads(false);                                 // don't pile up the ended threads
+    UpdateDevs();                                           // RtMidi numbers the current ports
+    opening = true;
+    open_port = port;
+    open_job = std::make_shared<OpenJob>();
+    open_job->driver = this;
+    open_job->conn = 0;
+    open_job->done = false;
+    open_job->exited = false;
+    open_job->thread = std::thread(OpenThread, open_job, PortKey(port), port, old);
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    open_jobs.push_back(open_job);
+}
+
+
+void MKB_MIDIDriver::JoinOpenThreads(bool all) {
+    std::vector<std::shared_ptr<OpenJob>> ended;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        for (size_t i = 0; i < open_jobs.size(); ) {
+            if ( all || open_jobs[i]->exited ) {
+                ended.push_back(open_jobs[i]);
+                open_jobs.erase(open_jobs.begin() + i);
+            }
+            else
+                i++;
+        }
+    }
+    for (size_t i = 0; i < ended.size(); i++)               // out of the lock: the threads use it
+        ended[i]->thread.join();
+}
+
+
+void MKB_MIDIDriver::OpenThread(std::shared_ptr<OpenJob> job, ConnKey key, unsigned int id,
+                                Connection* old) {
+    if (old)                                                // closing a port can be slow too
+        ReleaseConnection(old);
+    Connection* c = 0;
+    try {
+        c = AcquireConnection(key, id);
+    }
+    catch (RtError&) {}                                     // RtMidi has already printed the error
+    bool abandoned;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);      // the driver can't abandon the open now
+        abandoned = !job->driver;
+        if ( !abandoned ) {
+            job->conn = c;
+            job->done = true;
+            job->cond.notify_all();
+            job->driver->PostToMainThread(OpenDoneMainCB, job->driver->LiveToken());
+        }
+    }
+    if (abandoned && c)                                     // nobody wants the port
+        ReleaseConnection(c);
+    job->exited = true;                                     // JoinOpenThreads() can join it
+}
+
+
+void MKB_MIDIDriver::OpenDoneMainCB(void* p) {
+    MKB_MIDIDriver* d = FindLive(p);
+    if ( !d ) return;
+    d->CheckOpen();                                         // it could be already completed
+}
+
+
+void MKB_MIDIDriver::FinishOpen() {
+    if ( !opening || !open_job->done ) return;
+    Connection* c = open_job->conn;                         // the thread has ended
+    open_job.reset();
+    opening = false;
+    bool ok = (c != 0);
+    if ( open_again ) {                                     // open the last requested port, keeping the
+        open_again = false;                                 // pending messages for it
+        StartOpen(c);
+        return;
+    }
+    if ( ok ) {
+        {
+            std::lock_guard<std::mutex> lock(out_mutex);
+            conn = c;
+            out_open = true;
+        }
+        active_state = &port_states[c->uid];
+        SendSettings();
+        std::vector<Msg> run;                               // send the immediate messages in runs
+        for (size_t i = 0; i < pending_msgs.size(); i++) {
+            const AsyncEvent& ev = pending_msgs[i];
+            if (ev.time == 0) {
+                run.push_back(ev.msg);
+                continue;
+            }
+            if (!run.empty())
+                SendMIDIMessages(run.data(), run.size());
+            run.clear();
+            ScheduleMessage(ev.time, ev.msg.status, ev.msg.data1, ev.msg.data2);
+        }
+        if (!run.empty())
+            SendMIDIMessages(run.data(), run.size());
+    }
+    pending_msgs.clear();
+    OpenCallback cb = open_callback;
+    open_callback = 0;
+    if (cb)
+        cb(this, ok, open_callback_data);
+}
+
+
+void MKB_MIDIDriver::WaitOpen() {
+    while ( opening ) {                                     // FinishOpen() can start another open
+        {
+            std::unique_lock<std::mutex> lock(open_job->mutex);
+            while ( !open_job->done )
+                open_job->cond.wait(lock);
+        }
+        FinishOpen();
+    }
+}
+
+
+void MKB_MIDIDriver::AbandonOpen(bool report) {
+    if ( !opening ) return;
+    Connection* c = 0;
+    {
+        std::lock_guard<std::mutex> lock(open_job->mutex);
+        if ( open_job->done )                               // the thread has ended: the connection is ours
+            c = open_job->conn;
+        open_job->driver = 0;                               // otherwise the thread releases it
+    }
+    open_job.reset();
+    opening = false;
+    open_again = false;
+    pending_msgs.clear();
+    OpenCallback cb = open_callback;
+    open_callback = 0;
+    if (c)
+        ReleaseConnection(c);
+    if (cb && report)
+        cb(this, false, open_callback_data);
+}
+
+
+void MKB_MIDIDriver::AddPending(const Msg& msg, unsigned long long time) {
+    unsigned char type = msg.status & 0xf0;
+    if ( pending_policy == PENDING_DROP && (type == NOTE_OFF || type == NOTE_ON || type == POLY_PRESSURE) )
+        return;
+    if ( pending_msgs.size() < DEFAULT_ASYNC_CAPACITY ) {   // don't grow without limit
+        AsyncEvent ev = { msg, time };
+        pending_msgs.push_back(ev);
     }
 }
 
 
 void MKB_MIDIDriver::SendMIDIMessage ( unsigned char status, unsigned char byte1, unsigned char byte2 ) {
-    if ( out_open && status < 0xff && status != 0xf0 ) {   // dont send sysex or meta-events
-        message.clear();
-        message.push_back(status);
-        message.push_back(byte1);
-        message.push_back(byte2);
-        midi_out->sendMessage(&message);
+    CheckOpen();
+    if ( status < 0xff && status != 0xf0 ) {                // dont send sysex or meta-events
+        Msg msg = { status, byte1, byte2 };                 // no heap allocation for channel messages
+        if ( out_open ) {
+            if ( !IsRedundant(msg) )
+                Transmit(&msg, 1);
+        }
+        else if ( opening )
+            AddPending(msg, 0);
+    }
+}
+
+
+void MKB_MIDIDriver::SendMIDIMessages(const Msg* msgs, size_t n) {
+    CheckOpen();
+    if ( !out_open ) {
+        if ( opening )
+            for (size_t i = 0; i < n; i++)
+                if (msgs[i].status < 0xff && msgs[i].status != 0xf0)
+                    AddPending(msgs[i], 0);
+        return;
+    }
+    size_t first = 0;
+    for (size_t i = 0; i < n; i++) {                        // send the valid messages in runs, skipping
+        if (msgs[i].status < 0xff && msgs[i].status != 0xf0 &&  // sysex, meta-events and redundant messages
+            !IsRedundant(msgs[i])) continue;
+        if (i > first)
+            Transmit(msgs + first, i - first);
+        first = i + 1;
+    }
+    if (n > first)
+        Transmit(msgs + first, n - first);
+}
+
+
+void MKB_MIDIDriver::Transmit(const Msg* msgs, size_t n) {
+    if ( !async_queue ) {
+        std::lock_guard<std::mutex> lock(conn->mutex);      // another driver could be using it
+        if (n == 1)
+            conn->out->sendShortMessage(msgs->status, msgs->data1, msgs->data2);
+        else
+            conn->out->sendShortMessages(msgs, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        AsyncEvent ev = { msgs[i], 0 };
+        if ( !async_queue->push(ev) ) {
+            async_overflows.fetch_add(1, std::memory_order_relaxed);
+            ForgetState(msgs[i]);                           // it was not sent
+        }
+    }
+    WakeSender();
+}
+
+
+// Returns the delay (in seconds) from now to the given time of the driver clock.
+static double DelayTo(unsigned long long at_ns) {
+    unsigned long long now = MKB_MIDIDriver::GetTime();
+    return at_ns > now ? (at_ns - now) * 1e-9 : 0.0;
+}
+
+
+unsigned long long MKB_MIDIDriver::GetTime() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void MKB_MIDIDriver::ScheduleMessage(unsigned long long at_ns, unsigned char status, unsigned char byte1,
+                                     unsigned char byte2) {
+    CheckOpen();
+    if ( status >= 0xff || status == 0xf0 ) return;
+    Msg msg = { status, byte1, byte2 };
+    if ( !out_open ) {
+        if ( opening )
+            AddPending(msg, at_ns);
+        return;
+    }
+    ForgetState(msg);                                       // we don't know the state until it's delivered
+    if ( async_queue ) {                                    // the delay is computed by the sender thread
+        AsyncEvent ev = { msg, at_ns };
+        if ( !async_queue->push(ev) )
+            async_overflows.fetch_add(1, std::memory_order_relaxed);
+        WakeSender();
+    }
+    else {
+        std::lock_guard<std::mutex> lock(conn->mutex);
+        conn->out->scheduleShortMessage(DelayTo(at_ns), status, byte1, byte2);
+    }
+}
+
+
+void MKB_MIDIDriver::WakeSender() {
+    // the pushes must be visible before we read the flag (the sender thread does the opposite), otherwise
+    // both could miss each other; the lock is taken only if the sender thread is going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if ( async_sleeping.load(std::memory_order_relaxed) ) {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        wake_cond.notify_one();
+    }
+}
+
+
+bool MKB_MIDIDriver::StartAsyncOutput(size_t capacity /* = DEFAULT_ASYNC_CAPACITY */) {
+    if ( async_queue ) return false;
+    async_queue = new MKB_SPSCQueue<AsyncEvent>(capacity);
+    async_sleeping = false;
+    async_running = true;
+    async_thread = std::thread(&MKB_MIDIDriver::AsyncSenderLoop, this);
+    return true;
+}
+
+
+void MKB_MIDIDriver::StopAsyncOutput() {
+    if ( !async_queue ) return;
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        async_running = false;
+        wake_cond.notify_one();
+    }
+    async_thread.join();                                    // the thread sends all the queued messages
+    delete async_queue;
+    async_queue = 0;
+}
+
+
+void MKB_MIDIDriver::FlushAsyncOutput() {
+    if ( !async_queue ) return;
+    while ( !async_queue->empty() )
+        std::this_thread::yield();
+    std::lock_guard<std::mutex> lock(out_mutex);             // waits for the last group being sent
+}
+
+
+void MKB_MIDIDriver::AsyncSenderLoop() {
+    AsyncEvent events[128];
+    Msg msgs[128];
+    for (;;) {
+        size_t n;
+        {
+            std::lock_guard<std::mutex> lock(out_mutex);
+            n = async_queue->pop(events, 128);
+            if (n && out_open) {
+                std::lock_guard<std::mutex> clock(conn->mutex);
+                RtMidiOut* out = conn->out;
+                try {
+                    size_t nmsgs = 0;                       // the immediate messages are grouped for
+                    for (size_t i = 0; i < n; i++) {        // a single flush
+                        if (events[i].time == 0) {
+                            msgs[nmsgs++] = events[i].msg;
+                            continue;
+                        }
+                        if (nmsgs) {
+                            out->sendShortMessages(msgs, nmsgs);
+                            nmsgs = 0;
+                        }
+                        out->scheduleShortMessage(DelayTo(events[i].time), events[i].msg.status,
+                                                  events[i].msg.data1, events[i].msg.data2);
+                    }
+                    if (nmsgs)
+                        out->sendShortMessages(msgs, nmsgs);
+                }
+                catch (RtError&) {}                         // RtMidi has already reported it
+            }
+        }
+        if (n) continue;
+
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        async_sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);   // see WakeSender()
+        while (async_queue->empty() && async_running.load())
+            wake_cond.wait(lock);
+        async_sleeping.store(false, std::memory_order_relaxed);
+        if (async_queue->empty() && !async_running.load())
+            break;
     }
 }
 
 
 void MKB_MIDIDriver::AllNotesOff() {
-    unsigned char status;
+    Msg msgs[0x10];
     for (unsigned char i = 0; i < 0x10; i++) {
-        status=(unsigned char)(i << 4 | CONTROL_CHANGE);
-        SendMIDIMessage (status, C_ALL_NOTES_OFF, 0);
+        msgs[i].status = (unsigned char)(CONTROL_CHANGE | i);
+        msgs[i].data1 = C_ALL_NOTES_OFF;
+        msgs[i].data2 = 0;
+    }
+    SendMIDIMessages(msgs, 0x10);                           // one flush for all the channels
+}
+
+
+void MKB_MIDIDriver::ForceResync() {
+    PortState old = ActiveState();
+    ActiveState().Clear();
+    if ( !out_open ) return;
+
+    Msg msgs[0x10 * (C_ALL_SOUND_OFF + 2)];
+    size_t n = 0;
+    for (unsigned char ch = 0; ch < 0x10; ch++) {
+        for (unsigned char c = 0; c < C_ALL_SOUND_OFF; c++) {
+            if (old.ctrl[ch][c] >= 0) {
+                msgs[n].status = (unsigned char)(CONTROL_CHANGE | ch);
+                msgs[n].data1 = c;
+                msgs[n++].data2 = old.ctrl[ch][c];
+            }
+        }
+        if (old.prog[ch] >= 0) {                            // after the bank select
+            msgs[n].status = (unsigned char)(PROGRAM_CHANGE | ch);
+            msgs[n].data1 = old.prog[ch];
+            msgs[n++].data2 = 0;
+        }
+        if (old.bend[ch] >= 0) {
+            msgs[n].status = (unsigned char)(PITCH_BEND | ch);
+            msgs[n].data1 = old.bend[ch] & 0x7f;
+            msgs[n++].data2 = old.bend[ch] >> 7;
+        }
+    }
+    SendMIDIMessages(msgs, n);
+    SendSettings();                                         // the current settings (if not already sent)
+}
+
+
+void MKB_MIDIDriver::SendSettings() {
+    Msg init[3] = {                                         // program, volume and pan in a single group
+        { (unsigned char)(PROGRAM_CHANGE | channel), program, 0 },
+        { (unsigned char)(CONTROL_CHANGE | channel), C_MAIN_VOLUME, volume },
+        { (unsigned char)(CONTROL_CHANGE | channel), C_PAN, pan }
+    };
+    SendMIDIMessages(init, 3);
+}
+
+
+void MKB_MIDIDriver::PortState::Clear() {
+    memset(ctrl, -1, sizeof(ctrl));
+    memset(prog, -1, sizeof(prog));
+    for (int i = 0; i < 0x10; i++)
+        bend[i] = -1;
+}
+
+
+MKB_MIDIDriver::PortState& MKB_MIDIDriver::ActiveState() {
+    if ( states_stale.load(std::memory_order_relaxed) )
+        ClearStaleStates();
+    return active_state ? *active_state : closed_state;
+}
+
+
+void MKB_MIDIDriver::ClearStaleStates() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    for (size_t i = 0; i < stale_states.size(); i++) {
+        std::map<std::string, PortState>::iterator it = port_states.find(stale_states[i]);
+        if ( it != port_states.end() )
+            it->second.Clear();
+    }
+    stale_states.clear();
+    states_stale = false;
+}
+
+
+bool MKB_MIDIDriver::IsRedundant(const Msg& msg) {
+    PortState& st = ActiveState();
+    unsigned char ch = msg.status & 0x0f;
+
+    switch (msg.status & 0xf0) {
+        case PROGRAM_CHANGE:
+            if (st.prog[ch] == msg.data1) return true;
+            st.prog[ch] = msg.data1;
+            return false;
+        case PITCH_BEND: {
+            short value = msg.data1 | (msg.data2 << 7);
+            if (st.bend[ch] == value) return true;
+            st.bend[ch] = value;
+            return false;
+        }
+        case CONTROL_CHANGE:
+            switch (msg.data1) {
+                case C_DATA_ENTRY:                          // these have a meaning only in a sequence of
+                case C_DATA_ENTRY + C_LSB:                  // messages, so are always sent
+                case C_DATA_INC:
+                case C_DATA_DEC:
+                case C_NONRPN_LSB:
+                case C_NONRPN_MSB:
+                case C_RPN_LSB:
+                case C_RPN_MSB:
+                    return false;
+                case C_GM_BANK:                             // the bank is applied by the next program change,
+                case C_GM_BANK + C_LSB:                     // so this must be sent again
+                    st.prog[ch] = -1;
+                    break;
+                case C_RESET:                               // resets the controllers to unknown values
+                    memset(st.ctrl[ch], -1, sizeof(st.ctrl[ch]));
+                    st.bend[ch] = -1;
+                    return false;
+                default:
+                    break;
+            }
+            if (msg.data1 >= C_ALL_SOUND_OFF)               // channel mode messages
+                return false;
+            if (st.ctrl[ch][msg.data1] == msg.data2) return true;
+            st.ctrl[ch][msg.data1] = msg.data2;
+            return false;
+        default:                                            // notes, aftertouch and system messages
+            return false;
+    }
+}
+
+
+void MKB_MIDIDriver::ForgetState(const Msg& msg) {
+    PortState& st = ActiveState();
+    unsigned char ch = msg.status & 0x0f;
+
+    switch (msg.status & 0xf0) {
+        case PROGRAM_CHANGE:
+            st.prog[ch] = -1;
+            break;
+        case PITCH_BEND:
+            st.bend[ch] = -1;
+            break;
+        case CONTROL_CHANGE:
+            if (msg.data1 < C_ALL_SOUND_OFF)
+                st.ctrl[ch][msg.data1] = -1;
+            else if (msg.data1 == C_RESET) {
+                memset(st.ctrl[ch], -1, sizeof(st.ctrl[ch]));
+                st.bend[ch] = -1;
+            }
+            if (msg.data1 == C_GM_BANK || msg.data1 == C_GM_BANK + C_LSB)
+                st.prog[ch] = -1;
+            break;
     }
 }
 
 
 void MKB_MIDIDriver::SetActivePort(unsigned int id) {
-    bool was_open = out_open;
-    CloseMIDIOutPort();
+    bool was_open = out_open || opening;
+    CloseMIDIOutPort();                                     // this abandons a background open
     port = id;
     if (was_open)
         OpenMIDIOutPort();
@@ -69,7 +947,7 @@ void MKB_MIDIDriver::SetActivePort(unsigned int id) {
 void MKB_MIDIDriver::SetProgram(unsigned char p) {
     program = p & 0x7f;
 
-    unsigned char status=(unsigned char)(channel << 4 | PROGRAM_CHANGE);
+    unsigned char status=(unsigned char)(PROGRAM_CHANGE | channel);
     SendMIDIMessage(status, program, 0);
 }
 
@@ -77,26 +955,53 @@ void MKB_MIDIDriver::SetProgram(unsigned char p) {
 void MKB_MIDIDriver::SetVolume(unsigned char v) {
     volume = v & 0x7f;
 
-    unsigned char status=(unsigned char)(channel << 4 | CONTROL_CHANGE);
+    unsigned char status=(unsigned char)(CONTROL_CHANGE | channel);
     SendMIDIMessage(status, C_MAIN_VOLUME, volume);
 }
 
 
 void MKB_MIDIDriver::SetPan(unsigned char p) {
     pan = p & 0x7f;
-    unsigned char status=(unsigned char)(channel << 4 | CONTROL_CHANGE);
+    unsigned char status=(unsigned char)(CONTROL_CHANGE | channel);
     SendMIDIMessage(status, C_PAN, pan);
 }
 
 
 void MKB_MIDIDriver::NoteOn(unsigned char note) {
-    unsigned char status=(unsigned char)(channel << 4 | NOTE_ON);
+    unsigned char status=(unsigned char)(NOTE_ON | channel);
     SendMIDIMessage(status, note, note_vel);
 }
 
 
 void MKB_MIDIDriver::NoteOff(unsigned char note) {
-    unsigned char status=(unsigned char)(channel << 4 | NOTE_OFF);
+    unsigned char status=(unsigned char)(NOTE_OFF | channel);
     SendMIDIMessage(status, note, 0);
 
 }
+
+
+void MKB_MIDIDriver::NotesOn(const unsigned char* notes, size_t n) {
+    SendNotes(NOTE_ON, notes, n, note_vel);
+}
+
+
+void MKB_MIDIDriver::NotesOff(const unsigned char* notes, size_t n) {
+    SendNotes(NOTE_OFF, notes, n, 0);
+}
+
+
+void MKB_MIDIDriver::SendNotes(unsigned char status, const unsigned char* notes, size_t n, unsigned char vel) {
+    Msg msgs[128];                                          // no more than 128 notes per group
+    status = (unsigned char)(status | channel);
+    while (n) {
+        size_t count = n < 128 ? n : 128;
+        for (size_t i = 0; i < count; i++) {
+            msgs[i].status = status;
+            msgs[i].data1 = notes[i] & 0x7f;
+            msgs[i].data2 = vel;
+        }
+        SendMIDIMessages(msgs, count);
+        notes += count;
+        n -= count;
+    }
+}
@@ -5,33 +5,110 @@
 /// \file
 /// This file is the header for the MKB_MIDIDriver class.
 
+#include <cstddef>      // size_t
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 
 #include "RtMidi-2.0.1/RtMidi.h"
+#include "SPSCQueue.h"
+#include "KeySet.h"
 
 
 /// The class MKB_MIDIDriver sends MIDI messages to the computer MIDI ports.
 /// It can detect the MIDI ports present on the computer and send them some MIDI channel messages.
 /// You can select the port, the channel, the volume, the pan and a default velocity for note messages.
 /// The class Fl_MIDIKeyboard inherits from it.
-/// The cross-platform support is obtained by mean of an RtMidiOut object.
+/// The cross-platform support is obtained by mean of RtMidiOut objects, which are shared among all the drivers:
+/// the drivers using the same port share a single RtMidiOut (a single ALSA sequencer or JACK client), and another
+/// one is used by all of them for enumerating the ports. So many keyboards on the same port cost as one. Every
+/// driver keeps its own channel, program, volume and pan.
+///
+/// By default the messages are sent by the calling thread, which waits for the OS MIDI driver. Calling
+/// StartAsyncOutput() the driver enters the asynchronous mode: messages are only appended to a lock-free
+/// queue and a dedicated sender thread delivers them to the port, so the caller (usually the FLTK event
+/// loop) never blocks on MIDI I/O.
+///
+/// The drivers remember, for every port and channel, the last program, controller and pitch bend values sent,
+/// and doesn't send them again if they are unchanged (this saves bus bandwidth when the settings are re-applied
+/// or many drivers share the port). The RPN/NRPN and data entry controllers and the channel mode messages are
+/// always sent. The values are forgotten when no driver uses the port anymore and when the port disappears, so
+/// they are sent again to a reopened or reconnected device. If the device could have lost its state in other
+/// ways (it was switched off) call ForceResync().
 class MKB_MIDIDriver {
     public:
 
-        /// The constructor.
-                            MKB_MIDIDriver();
+        /// A MIDI channel message, as used by SendMIDIMessages().
+        /// Its members are the *status*, *data1* and *data2* bytes.
+        typedef RtMidiOut::ShortMessage Msg;
+
+        /// The type of the function called when the MIDI ports change (see SetDevsChangedCallback()).
+        typedef void (*DevsCallback)(MKB_MIDIDriver* driver, void* p);
+
+        /// The type of the function called when an asynchronous open ends (see OpenMIDIOutPortAsync()).
+        /// *ok* is false if the port could not be opened.
+        typedef void (*OpenCallback)(MKB_MIDIDriver* driver, bool ok, void* p);
+
+        /// What to do with the notes sent while a port is being opened asynchronously
+        /// (see SetPendingPolicy()).
+        enum PendingPolicy {
+            PENDING_BUFFER,             ///< the notes are sent when the port is open
+            PENDING_DROP                ///< the notes are lost
+        };
+
+        /// The driver modes (see the constructor).
+        enum DriverMode {
+            MIDI_OUTPUT,                ///< the driver sends MIDI messages
+            DISPLAY_ONLY                ///< the driver never uses the MIDI ports
+        };
+
+        /// The constructor. No MIDI backend is initialized here: the ports are enumerated only when they are
+        /// first requested and opened by OpenMIDIOutPort(), so creating many drivers is cheap.
+        /// \param mode if it is \ref DISPLAY_ONLY the driver never touches the MIDI backend: there are no
+        /// ports, and the functions which open them and send messages do nothing (this is useful for the
+        /// keyboards which only show notes)
+                            MKB_MIDIDriver(DriverMode mode = MIDI_OUTPUT);
 
         /// The destructor.
         virtual             ~MKB_MIDIDriver();
 
         /// Returns the number of MIDI ports present in the computer.
-        int                 GetNumMIDIOutDevs()     { return midi_out->getPortCount(); }
-
-        /// Returns the OS name of the port *id*.
-        const char*         GetMIDIOutDevName(unsigned int id)
-                                                    { return midi_out->getPortName(id).c_str(); }
+        /// The ports are enumerated only the first time and when they change, so this and the other port
+        /// functions are fast.
+        int                 GetNumMIDIOutDevs();
+
+        /// Returns the OS name of the port *id* ("" if it doesn't exist). The string remains valid until the
+        /// ports change.
+        const char*         GetMIDIOutDevName(unsigned int id);
+
+        /// Returns a string which identifies the port *id* ("" if it doesn't exist), even when its number
+        /// changes because other ports appear or disappear. The string remains valid until the ports change.
+        const char*         GetMIDIOutDevUID(unsigned int id);
+
+        /// Returns the number of the port with the given identifier (see GetMIDIOutDevUID()), or -1 if it is
+        /// not present.
+        int                 FindMIDIOutDev(const char* uid);
+
+        /// Enumerates the MIDI ports again. With ALSA and JACK this is done automatically when the ports
+        /// change; with the other APIs call it when you think the ports could have changed.
+        void                RefreshMIDIOutDevs();
+
+        /// Sets a function to be called (in the main thread) when MIDI ports appear or disappear (only with
+        /// ALSA and JACK). When it's called the port numbers could have changed: the driver keeps the same
+        /// active port, updating its number, while you should rebuild your port menus. If PostToMainThread() is
+        /// not redefined the function is called by the first driver function called after the change (see
+        /// DispatchEvents()).
+        /// \param cb the function (0 for none)
+        /// \param p a pointer passed to the function
+        void                SetDevsChangedCallback(DevsCallback cb, void* p = 0)
+                                                    { devs_callback = cb; devs_callback_data = p; }
 
         /// Opens the currently set MIDI port, assigning current program, volume and pan.
         void                OpenMIDIOutPort ();
@@ -39,20 +116,145 @@ class MKB_MIDIDriver {
         /// Closes the currently opened MIDI port.
         void                CloseMIDIOutPort();
 
+        /// Opens the currently set MIDI port as OpenMIDIOutPort(), but in a background thread: the caller
+        /// doesn't wait for the OS (opening a JACK connection or a slow USB device can take hundreds of ms).
+        /// When the port is open, or the open has failed, *cb* is called in the main thread (see
+        /// PostToMainThread()). The messages sent in the meanwhile are sent when the port is open, while the
+        /// notes are buffered or dropped according to SetPendingPolicy(). OpenMIDIOutPort(), called during
+        /// the open, waits for its end, while CloseMIDIOutPort() and SetActivePort() abandon it (*cb* is called
+        /// with *ok* false, and the background thread closes the port). If PostToMainThread() is not redefined
+        /// the open is completed
+        /// (and *cb* called) by the first driver function called after its end (see DispatchEvents()).
+        /// \param cb the function to call at the end (0 for none)
+        /// \param p a pointer passed to the function
+        void                OpenMIDIOutPortAsync(OpenCallback cb = 0, void* p = 0);
+
+        /// Sets the active MIDI port as SetActivePort(), but closing and opening the ports in a background
+        /// thread (see OpenMIDIOutPortAsync()). If it is called again before the end, only the last port is
+        /// opened. If no port is open (nor being opened) the port is only selected, and *cb* is called at once
+        /// with *ok* false.
+        void                SetActivePortAsync(unsigned int id, OpenCallback cb = 0, void* p = 0);
+
+        /// Returns true if a port is being opened in the background.
+        bool                IsOpening() const       { return opening; }
+
+        /// Sets what to do with the notes sent while a port is being opened asynchronously. The default
+        /// is \ref PENDING_BUFFER.
+        void                SetPendingPolicy(PendingPolicy pol)     { pending_policy = pol; }
+
+        /// Returns the current policy for the notes sent while a port is being opened.
+        PendingPolicy       GetPendingPolicy() const    { return pending_policy; }
+
+        /// Returns the mode given in the constructor.
+        DriverMode          GetDriverMode() const   { return mode; }
+
+        /// Makes the calls queued by the default PostToMainThread(): the notifications of the port changes, of
+        /// the end of a background open and of the input keys changes. The other driver functions call it, so
+        /// you need to call it (periodically, in the main thread) only if you want these notifications when
+        /// you are not using the driver. It does nothing if PostToMainThread() is redefined.
+        void                DispatchEvents()
+                                { if ( posted_any.load(std::memory_order_acquire) ) RunPostedCalls(); }
+
+        /// Returns the number of MIDI input ports present in the computer. This enumerates the input ports
+        /// again.
+        int                 GetNumMIDIInDevs();
+
+        /// Returns the OS name of the input port *id* ("" if it doesn't exist). The string remains valid until
+        /// the next GetNumMIDIInDevs().
+        const char*         GetMIDIInDevName(unsigned int id);
+
+        /// Opens the MIDI input port *id* (closing the previous one). From now on the note on and note off
+        /// messages received on any channel change the input keys (see GetMIDIInKeys()). The messages are
+        /// handled in the RtMidi input thread, which only updates an atomic set of keys: the driver is notified
+        /// in the main thread by MIDIInChanged(), with a single call for any number of messages, so floods of
+        /// incoming messages never back up the main thread. It does nothing in \ref DISPLAY_ONLY mode.
+        /// \exception RtError if the port cannot be opened
+        void                OpenMIDIInPort(unsigned int id);
+
+        /// Closes the MIDI input port, releasing all the input keys.
+        void                CloseMIDIInPort();
+
+        /// Returns true if a MIDI input port is open.
+        bool                IsMIDIInOpen() const    { return in_open; }
+
+        /// If *on* is true the sustain pedal (controller 64) received from the input port holds the released
+        /// keys until it's released (the default is false).
+        void                SetMIDIInSustain(bool on)   { in_sustain = on; }
+
+        /// Returns true if the input port sustain pedal is handled.
+        bool                GetMIDIInSustain() const    { return in_sustain; }
+
+        /// Returns the keys currently held down on the MIDI input port (the keys held by the sustain pedal
+        /// too). Calling this also allows the next call to MIDIInChanged().
+        MKB_KeySet          GetMIDIInKeys();
+
         /// Sends a MIDI message to the currently opened port.
         /// \param status the MIDI status byte (MIDI channel and message type info)
         /// \param byte1, byte2 other MIDI bytes in the message, according to the message type
         void                SendMIDIMessage(unsigned char status, unsigned char byte1, unsigned char byte2);
 
+        /// Sends a group of MIDI messages to the currently opened port.
+        /// The messages are sent in order as with SendMIDIMessage(), but the output is flushed only once, so
+        /// the whole group costs a single round-trip to the OS MIDI driver.
+        /// \param msgs an array of MIDI messages
+        /// \param n the number of messages in the array
+        void                SendMIDIMessages(const Msg* msgs, size_t n);
+
+        /// Returns the current time of the driver clock, in nanoseconds. It is a monotonic clock with an
+        /// arbitrary origin, used for ScheduleMessage().
+        static unsigned long long GetTime();
+
+        /// Sends a MIDI message to the currently opened port at the given time.
+        /// The message is immediately handed to the OS MIDI driver, which delivers it in time (ALSA uses a
+        /// sequencer queue, JACK a frame offset and CoreMIDI a timestamp), so the timing doesn't depend on the
+        /// load of the calling thread. With the other APIs the message is sent immediately. Messages scheduled
+        /// in the past are sent immediately, while messages not yet delivered when the port is closed can be
+        /// lost.
+        /// \param at_ns the time of the message, as given by GetTime()
+        /// \param status, byte1, byte2 the message bytes, as in SendMIDIMessage()
+        void                ScheduleMessage(unsigned long long at_ns, unsigned char status, unsigned char byte1,
+                                            unsigned char byte2);
+
         /// Turns off all the notes.
         void                AllNotesOff();
 
+        /// Forgets the values remembered for the active port (see the class description) and sends them again
+        /// (if the port is open): the current program, volume and pan and all the other program, controller and
+        /// pitch bend values previously sent to the port. Call this when the device has been reconnected.
+        void                ForceResync();
+
+        /// Enters the asynchronous output mode, starting the sender thread. From now on the messages are
+        /// appended to a lock-free queue and sent to the port by the sender thread, in the same order. If the
+        /// queue is full the new messages are dropped (see GetAsyncOverflows()). All the messages must still
+        /// be sent by the same thread (the one which calls this).
+        /// \param capacity the size of the queue, in messages (rounded up to a power of two)
+        /// \return false if the mode was already active
+        bool                StartAsyncOutput(size_t capacity = DEFAULT_ASYNC_CAPACITY);
+
+        /// Returns to the synchronous output mode: all the queued messages are sent, then the sender thread
+        /// is stopped.
+        void                StopAsyncOutput();
+
+        /// Returns true if the asynchronous output mode is active.
+        bool                IsAsyncOutput() const   { return async_queue != 0; }
+
+        /// Waits until all the messages queued in asynchronous mode have been sent to the port. It does
+        /// nothing in synchronous mode.
+        void                FlushAsyncOutput();
+
+        /// Returns the number of messages dropped because the asynchronous queue was full.
+        unsigned long       GetAsyncOverflows() const
+                                                    { return async_overflows.load(std::memory_order_relaxed); }
+
+        /// Resets to 0 the count of dropped messages.
+        void                ResetAsyncOverflows()   { async_overflows.store(0, std::memory_order_relaxed); }
+
         /// Sets the active MIDI port.
         /// \param id an integer in the range 0 ... GetNumMIDIOutDevs() - 1.
         void                SetActivePort(unsigned int id);
 
         /// Returns the active MIDI port. You can call GetMIDIOutDevName() if you want to know the name of the
-        /// port.
+        /// port. The number can change when other ports appear or disappear (see SetDevsChangedCallback()).
         int                 GetActivePort()         { return port; }
 
         /// Sets the MIDI channel (range is 1 ...16).
@@ -92,6 +294,14 @@ class MKB_MIDIDriver {
         /// Sends to the selected port a MIDI Note off message.
         void                NoteOff(unsigned char note);
 
+        /// Sends to the selected port a MIDI Note on message for each of the *n* notes in the array, as a
+        /// single group (see SendMIDIMessages()).
+        void                NotesOn(const unsigned char* notes, size_t n);
+
+        /// Sends to the selected port a MIDI Note off message for each of the *n* notes in the array, as a
+        /// single group.
+        void                NotesOff(const unsigned char* notes, size_t n);
+
 
 /// MIDI Messages status bytes (only channel messages will be output by the driver).
         enum {
@@ -183,6 +393,8 @@ class MKB_MIDIDriver {
 
     protected:
 
+        static const size_t DEFAULT_ASYNC_CAPACITY = 1024;  ///< default size of the asynchronous output queue
+
         bool                out_open;           ///< True if the port is open
 
         unsigned int        port;               ///< Number of the selected port
@@ -192,12 +404,253 @@ class MKB_MIDIDriver {
         unsigned char       pan;                ///< Amount of the MIDI pan (0 - 127)
         unsigned char       note_vel;           ///< Default velocity for Note On messages
 
-        RtMidiOut*          midi_out;           ///< The object which sends messages to hardware
+        /// Calls fn(p) in the main thread of the program. The driver uses it to report events which happen
+        /// in other threads, so it must not call fn directly. The default queues the call, which is made by
+        /// the next driver function called in the main thread (see DispatchEvents()): Fl_MIDIKeyboard
+        /// redefines it using Fl::awake().
+        virtual void        PostToMainThread(void (*fn)(void*), void* p);
+
+        /// Called in the main thread (see PostToMainThread()) when the input keys change. There are no other
+        /// calls until GetMIDIInKeys() is called, so a redefinition can read the keys when it is ready to show
+        /// them (Fl_MIDIKeyboard does it at the next frame). The default does nothing.
+        virtual void        MIDIInChanged()         {}
+
+        /// Stops the calls of PostToMainThread() and MIDIInChanged() from the other threads: the driver is no
+        /// longer notified of the port changes, a background open is abandoned and the MIDI input port is
+        /// closed. A class which redefines them must call this in its destructor, because the threads could
+        /// call them while the object is being destroyed (the base destructor would be too late).
+        void                StopNotifications();
 
     private:
 
-        std::vector<unsigned char>
-                            message;
+        /// Sends a note message with the given status for each note in the array.
+        void                SendNotes(unsigned char status, const unsigned char* notes, size_t n, unsigned char vel);
+
+        /// Delivers a group of valid messages to the port: directly in synchronous mode, through the queue
+        /// in asynchronous mode.
+        void                Transmit(const Msg* msgs, size_t n);
+
+        /// Wakes the sender thread, if it is waiting for new messages.
+        void                WakeSender();
+
+        /// The body of the sender thread.
+        void                AsyncSenderLoop();
+
+        /// Returns true if the message would not change the state of the active port (so it doesn't need to
+        /// be sent), otherwise records the new state.
+        bool                IsRedundant(const Msg& msg);
+
+        /// Forgets the state of the active port which the message would change.
+        void                ForgetState(const Msg& msg);
+
+        /// Enumerates the ports again, if they have changed.
+        void                UpdateDevs()
+                                { DispatchEvents(); if (devs_changed.load()) RefreshMIDIOutDevs(); }
+
+        /// Makes the calls queued by the default PostToMainThread().
+        void                RunPostedCalls();
+
+        /// Enumerates the input ports again, storing their names.
+        void                RefreshMIDIInDevs();
+
+        /// Makes the driver a user of the shared RtMidiOut which enumerates the ports, creating it if
+        /// needed.
+        /// \return false in \ref DISPLAY_ONLY mode
+        bool                AcquirePorts();
+
+        /// Called by the shared RtMidiOut (in another thread) when the ports change. It notifies all the
+        /// drivers.
+        static void         PortsChangedCB(void* p);
+
+        /// Called in the main thread after PortsChangedCB().
+        static void         DevsChangedMainCB(void* p);
+
+        /// Closes the MIDI input port, releasing the input keys. MIDIInChanged() is called only if *notify*
+        /// is true.
+        void                CloseInput(bool notify);
+
+        /// Creates the RtMidiIn used for the input.
+        /// \return false in \ref DISPLAY_ONLY mode
+        bool                AcquireInput();
+
+        /// Called by the RtMidiIn (in its thread) with the incoming messages gathered at every wakeup: the
+        /// input keys are published once for all of them.
+        static void         InputBatchCB(const RtMidiIn::BatchMessage* msgs, unsigned int count, void* p);
+
+        /// Updates the held and sustained input keys with a message (in the input thread).
+        void                ApplyInput(const unsigned char* msg, unsigned int size);
+
+        /// Stores the input keys for the main thread and notifies it (only if it has read the previous ones).
+        void                PublishInput();
+
+        /// Called in the main thread after InputBatchCB().
+        static void         InputMainCB(void* p);
+
+        /// Returns the driver identified by the token passed to a function called in the main thread, or 0 if
+        /// it has been destroyed (or is being destroyed). The tokens are never reused, so a new driver at the
+        /// same address is not mistaken for the old one.
+        static MKB_MIDIDriver* FindLive(void* token);
+
+        /// Returns the token which identifies the driver (see FindLive()).
+        void*               LiveToken() const       { return (void*)live_id; }
+
+        /// A MIDI port opened by one or more drivers.
+        struct Connection {
+            RtMidiOut*          out;
+            std::mutex          mutex;          // serializes the use of out among the drivers (and their
+                                                // sender threads)
+            int                 users;          // the number of drivers which use it
+            std::string         uid;            // the port UID (its key in port_states)
+        };
+
+        typedef std::pair<RtMidi::Api, std::string> ConnKey;
+
+        /// Returns the key of the connection to the port *id* (in the main thread).
+        ConnKey             PortKey(unsigned int id)
+                                { return ConnKey(ports_out->getCurrentApi(), GetMIDIOutDevUID(id)); }
+
+        /// Returns the connection to the port with the given key and number (opening it if no driver
+        /// uses it). The number is checked against the UID, as the ports could have changed: if it doesn't
+        /// match the port is looked for by its UID. It can be called in any thread, even if all the drivers
+        /// have been destroyed.
+        /// \exception RtError if the port cannot be opened
+        static Connection*  AcquireConnection(const ConnKey& key, unsigned int id);
+
+        /// Releases a connection returned by AcquireConnection(), closing the port if no other driver uses it.
+        static void         ReleaseConnection(Connection* c);
+
+        /// A background open, shared by the driver and its thread (which can outlive the driver).
+        struct OpenJob {
+            MKB_MIDIDriver*     driver;         // 0 if the driver has abandoned the open
+            Connection*         conn;           // the result (0 if the open failed)
+            std::atomic<bool>   done;           // set by the thread when it ends
+            std::mutex          mutex;          // protects driver, conn and done
+            std::condition_variable cond;       // signaled when done is set
+            std::thread         thread;         // joined by JoinOpenThreads()
+            std::atomic<bool>   exited;         // set by the thread as its last action
+        };
+
+        /// Starts the background thread which releases the old connection (if any) and opens the port.
+        void                StartOpen(Connection* old);
+
+        /// The body of the background thread. If the open has been abandoned it releases the connection.
+        static void         OpenThread(std::shared_ptr<OpenJob> job, ConnKey key, unsigned int id,
+                                       Connection* old);
+
+        /// Joins the threads of the background opens which have ended, or all of them if *all* is true (when
+        /// the last driver is destroyed, so no thread uses the static members after the program exit).
+        static void         JoinOpenThreads(bool all);
+
+        /// Called in the main thread at the end of the background open.
+        static void         OpenDoneMainCB(void* p);
+
+        /// Completes the background open (if it has ended).
+        void                FinishOpen();
+
+        /// Waits for the end of the background open (if any, and of the ones it could start), then completes
+        /// it.
+        void                WaitOpen();
+
+        /// Abandons the background open (if any) without waiting for it: the thread will release the
+        /// connection. If *report* is true the open callback is called with *ok* false.
+        void                AbandonOpen(bool report);
+
+        /// Completes the background open if it has ended (it could not have been completed by
+        /// OpenDoneMainCB(), see PostToMainThread()).
+        void                CheckOpen()
+                                { DispatchEvents(); if (opening && open_job->done) FinishOpen(); }
+
+        /// Keeps a message sent while the port is being opened.
+        void                AddPending(const Msg& msg, unsigned long long time);
+
+        /// Sends the current program, volume and pan in a single group.
+        void                SendSettings();
+
+        /// A message in the asynchronous output queue.
+        struct AsyncEvent {
+            Msg                 msg;
+            unsigned long long  time;           // the scheduled time (0 for an immediate message)
+        };
+
+        MKB_SPSCQueue<AsyncEvent>* async_queue; // the output queue (0 in synchronous mode)
+        std::thread         async_thread;       // the sender thread
+        std::mutex          out_mutex;          // held by the sender thread while using conn
+        std::mutex          wake_mutex;         // these are used for waking the sender thread
+        std::condition_variable wake_cond;
+        std::atomic<bool>   async_sleeping;     // true if the sender thread is waiting on wake_cond
+        std::atomic<bool>   async_running;      // false asks the sender thread to exit
+        std::atomic<unsigned long> async_overflows;
+
+        /// The last values sent to a port, for each channel (-1 if unknown).
+        struct PortState {
+            signed char         ctrl[16][128];
+            signed char         prog[16];
+            short               bend[16];
+
+                                PortState()     { Clear(); }
+            void                Clear();
+        };
+
+        /// Returns the state of the open port (bound to its UID when it was opened, so the ports are never
+        /// enumerated while sending), or a scratch state if no port is open.
+        PortState&          ActiveState();
+
+        /// Clears the states of the ports closed by ReleaseConnection() (which can run in another thread).
+        static void         ClearStaleStates();
+
+        static std::map<std::string, PortState> port_states;    // indexed by port UID, shared by all drivers
+        static std::vector<std::string> stale_states;   // the UIDs of the closed ports (protected by pool_mutex)
+        static std::atomic<bool> states_stale;  // true if stale_states is not empty
+        static PortState    closed_state;       // the scratch state returned by ActiveState() if no port is open
+        PortState*          active_state;       // the state of the open port (0 if closed)
+
+        std::vector<RtMidiOut::PortInfo> devs;  // the ports
+        std::atomic<bool>   devs_changed;       // true if the ports must be enumerated again
+        std::atomic<bool>   devs_posted;        // true if DevsChangedMainCB() is waiting to be called
+        DevsCallback        devs_callback;
+        void*               devs_callback_data;
+
+        struct PostedCall {                     // a call queued by the default PostToMainThread()
+            void                (*fn)(void*);
+            void*               p;
+        };
+        std::vector<PostedCall> posted_calls;
+        std::mutex          posted_mutex;       // protects posted_calls
+        std::atomic<bool>   posted_any;         // true if posted_calls is not empty
+
+        static std::map<uintptr_t, MKB_MIDIDriver*> live_drivers;  // indexed by token
+        static uintptr_t    last_live_id;
+        static std::mutex   live_mutex;         // protects the static members above
+        uintptr_t           live_id;            // the token of the driver
+
+        Connection*         conn;               // the open port (0 if closed)
+        DriverMode          mode;
+        bool                ports_acquired;     // true if the driver is a user of ports_out
+
+        static std::map<ConnKey, Connection*> connections;
+        static RtMidiOut*   ports_out;          // enumerates the ports for all the drivers
+        static int          ports_users;
+        static std::vector<std::shared_ptr<OpenJob>> open_jobs; // the jobs whose thread is not joined
+        static std::mutex   pool_mutex;         // protects the static members above
+
+        std::shared_ptr<OpenJob> open_job;      // the background open for OpenMIDIOutPortAsync()
+        bool                opening;            // true from OpenMIDIOutPortAsync() to FinishOpen()
+        bool                open_again;         // true if another port was requested during the open
+        unsigned int        open_port;          // the port being opened
+        OpenCallback        open_callback;
+        void*               open_callback_data;
+        PendingPolicy       pending_policy;
+        std::vector<AsyncEvent> pending_msgs;   // the messages sent during the open
+
+        RtMidiIn*           midi_in;            // the input (0 if not yet created)
+        std::vector<std::string> in_devs;       // the input port names
+        bool                in_open;
+        MKB_KeySet          in_held;            // these are used only by the input thread: keys held down,
+        MKB_KeySet          in_sustained;       // keys released but held by the sustain pedal
+        bool                in_pedal;           // and the pedal status
+        std::atomic<bool>   in_sustain;         // handle the pedal
+        std::atomic<uint64_t> in_keys[2];       // the input keys (in_held | in_sustained) for the main thread
+        std::atomic<bool>   in_posted;          // true if the main thread has not yet read the input keys
 };
 
 
@@ -0,0 +1,110 @@
+#ifndef SPSCQUEUE_H_INCLUDED
+#define SPSCQUEUE_H_INCLUDED
+
+/// \file
+/// This file contains the MKB_SPSCQueue class template, used to pass MIDI events between two threads.
+
+#include <cstddef>
+#include <atomic>
+
+
+/// The class MKB_SPSCQueue is a fixed capacity, lock-free, single producer / single consumer FIFO queue.
+/// One thread (the producer) can only call push(), another thread (the consumer) can only call pop(); both
+/// calls never block and never allocate memory, so the producer is never delayed by the consumer (and vice
+/// versa). The queue is used by MKB_MIDIDriver for its asynchronous output.
+/// The template parameter T must be a copyable type.
+template <class T>
+class MKB_SPSCQueue {
+    public:
+
+        /// The constructor allocates the ring. The capacity is rounded up to a power of two.
+                            MKB_SPSCQueue(size_t cap);
+
+        /// The destructor.
+                            ~MKB_SPSCQueue()        { delete [] ring; }
+
+        /// Returns the maximum number of items the queue can hold.
+        size_t              capacity() const        { return mask + 1; }
+
+        /// Returns true if the queue is empty. It can be called by both threads, but the result is only
+        /// a snapshot.
+        bool                empty() const
+                                { return head.load(std::memory_order_acquire) ==
+                                         tail.load(std::memory_order_acquire); }
+
+        /// Appends an item to the queue (producer thread only).
+        /// \return false if the queue is full (the item is not added)
+        bool                push(const T& item);
+
+        /// Removes the first item from the queue (consumer thread only).
+        /// \return false if the queue is empty
+        bool                pop(T& item);
+
+        /// Removes up to *max* items from the queue, copying them into the *items* array (consumer thread
+        /// only).
+        /// \return the number of removed items
+        size_t              pop(T* items, size_t max);
+
+    private:
+
+        // head is written only by the producer and tail only by the consumer. They always grow (wrapping
+        // around) and the item index is obtained masking them, so no shared counter is needed.
+        std::atomic<size_t> head;
+        char                pad[64];            // keeps head and tail in different cache lines
+        std::atomic<size_t> tail;
+
+        T*                  ring;
+        size_t              mask;
+
+                            MKB_SPSCQueue(const MKB_SPSCQueue&);        // not copyable
+        MKB_SPSCQueue&      operator=(const MKB_SPSCQueue&);
+};
+
+
+template <class T>
+MKB_SPSCQueue<T>::MKB_SPSCQueue(size_t cap) :
+    head(0), tail(0) {
+    size_t size = 2;
+    while (size < cap)
+        size <<= 1;
+    ring = new T[size];
+    mask = size - 1;
+}
+
+
+template <class T>
+bool MKB_SPSCQueue<T>::push(const T& item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) > mask)
+        return false;                                   // full
+    ring[h & mask] = item;
+    head.store(h + 1, std::memory_order_release);       // publish the item
+    return true;
+}
+
+
+template <class T>
+bool MKB_SPSCQueue<T>::pop(T& item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+        return false;                                   // empty
+    item = ring[t & mask];
+    tail.store(t + 1, std::memory_order_release);       // give the slot back to the producer
+    return true;
+}
+
+
+template <class T>
+size_t MKB_SPSCQueue<T>::pop(T* items, size_t max) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t n = head.load(std::memory_order_acquire) - t;
+    if (n > max)
+        n = max;
+    for (size_t i = 0; i < n; i++)
+        items[i] = ring[(t + i) & mask];
+    tail.store(t + n, std::memory_order_release);
+    return n;
+}
+
+
+#endif // SPSCQUEUE_H_INCLUDED
@@ -40,6 +40,8 @@
 
 #include "RtMidi.h"
 #include <sstream>
+#include <cstring>
+#include <thread>
 
 //*********************************************************************//
 //  RtMidi Definitions
@@ -165,7 +167,7 @@ RtMidiIn :: ~RtMidiIn() throw()
 //  RtMidiOut Definitions
 //*********************************************************************//
 
-void RtMidiOut :: openMidiApi( RtMidi::Api api, const std::string clientName )
+void RtMidiOut :: openMidiApi( RtMidi::Api api, const std::string clientName, unsigned int bufferSize )
 {
   if ( rtapi_ )
     delete rtapi_;
@@ -173,7 +175,7 @@ void RtMidiOut :: openMidiApi( RtMidi::Api api, const std::string clientName )
 
 #if defined(__UNIX_JACK__)
   if ( api == UNIX_JACK )
-    rtapi_ = new MidiOutJack( clientName );
+    rtapi_ = new MidiOutJack( clientName, bufferSize );
 #endif
 #if defined(__LINUX_ALSA__)
   if ( api == LINUX_ALSA )
@@ -197,13 +199,13 @@ void RtMidiOut :: openMidiApi( RtMidi::Api api, const std::string clientName )
 #endif
 }
 
-RtMidiOut :: RtMidiOut( RtMidi::Api api, const std::string clientName )
+RtMidiOut :: RtMidiOut( RtMidi::Api api, const std::string clientName, unsigned int bufferSize )
 {
   rtapi_ = 0;
 
   if ( api != UNSPECIFIED ) {
     // Attempt to open the specified API.
-    openMidiApi( api, clientName );
+    openMidiApi( api, clientName, bufferSize );
     if ( rtapi_ ) return;
 
     // No compiled support for specified API value.  Issue a debug
@@ -216,7 +218,7 @@ RtMidiOut :: RtMidiOut( RtMidi::Api api, const std::string clientName )
   std::vector< RtMidi::Api > apis;
   getCompiledApi( apis );
   for ( unsigned int i=0; i<apis.size(); i++ ) {
-    openMidiApi( apis[i], clientName );
+    openMidiApi( apis[i], clientName, bufferSize );
     if ( rtapi_->getPortCount() ) break;
   }
 
@@ -242,15 +244,54 @@ MidiInApi :: MidiInApi( unsigned int queueSizeLimit )
   : apiData_( 0 ), connected_( false )
 {
   // Allocate the MIDI queue.
-  inputData_.queue.ringSize = queueSizeLimit;
-  if ( inputData_.queue.ringSize > 0 )
-    inputData_.queue.ring = new MidiMessage[ inputData_.queue.ringSize ];
+  if ( queueSizeLimit > 0 ) {
+    inputData_.queue.ringSize = queueSizeLimit + 1;
+    inputData_.queue.ring = new MidiQueue::Slot[ inputData_.queue.ringSize ];
+    inputData_.queue.slab = new unsigned char[ MidiQueue::SLAB_SIZE ];
+  }
 }
 
 MidiInApi :: ~MidiInApi( void )
 {
   // Delete the MIDI queue.
-  if ( inputData_.queue.ringSize > 0 ) delete [] inputData_.queue.ring;
+  delete [] inputData_.queue.ring;
+  delete [] inputData_.queue.slab;
+}
+
+bool MidiInApi :: MidiQueue :: push( const unsigned char *bytes, unsigned int nBytes, double timeStamp )
+{
+  if ( ringSize == 0 ) return false;
+  unsigned int b = back.load( std::memory_order_relaxed );
+  unsigned int next = b + 1 == ringSize ? 0 : b + 1;
+  if ( next == front.load( std::memory_order_acquire ) ) return false;   // full
+  Slot &slot = ring[b];
+  if ( nBytes <= SLOT_BYTES ) {
+    for ( unsigned int i=0; i<nBytes; i++ ) slot.bytes[i] = bytes[i];
+  }
+  else {
+    // The message is stored contiguously: if it doesn't fit at the end
+    // of the slab, it starts again from the beginning.
+    unsigned int start = slabBack;
+    unsigned int pos = start & ( SLAB_SIZE - 1 );
+    if ( pos + nBytes > SLAB_SIZE ) start += SLAB_SIZE - pos;
+    if ( nBytes > SLAB_SIZE || start + nBytes - slabFront.load( std::memory_order_acquire ) > SLAB_SIZE )
+      return false;
+    memcpy( slab + ( start & ( SLAB_SIZE - 1 ) ), bytes, nBytes );
+    slot.slabStart = start;
+    slot.slabEnd = slabBack = start + nBytes;
+  }
+  slot.size = nBytes;
+  slot.timeStamp = timeStamp;
+  back.store( next, std::memory_order_release );                         // publish the slot
+  return true;
+}
+
+void MidiInApi :: MidiQueue :: pop( void )
+{
+  unsigned int f = front.load( std::memory_order_relaxed );
+  if ( ring[f].size > SLOT_BYTES )                                       // give back the slab space
+    slabFront.store( ring[f].slabEnd, std::memory_order_release );
+  front.store( f + 1 == ringSize ? 0 : f + 1, std::memory_order_release );
 }
 
 void MidiInApi :: setCallback( RtMidiIn::RtMidiCallback callback, void *userData )
@@ -272,6 +313,44 @@ void MidiInApi :: setCallback( RtMidiIn::RtMidiCallback callback, void *userData
   inputData_.usingCallback = true;
 }
 
+// Used as the user callback by the APIs which don't gather the
+// messages for the batch callback: it passes them one by one.
+static void batchAdapter( double timeStamp, std::vector<unsigned char> *message, void *userData )
+{
+  MidiInApi::RtMidiInData *data = (MidiInApi::RtMidiInData *) userData;
+  RtMidiIn::BatchMessage m;
+  m.timeStamp = timeStamp;
+  m.bytes = message->empty() ? 0 : &(*message)[0];
+  m.size = message->size();
+  RtMidiIn::RtMidiBatchCallback callback = (RtMidiIn::RtMidiBatchCallback) data->batchCallback.load();
+  if ( callback )
+    callback( &m, 1, data->batchUserData );
+}
+
+void MidiInApi :: setBatchCallback( RtMidiIn::RtMidiBatchCallback callback, void *userData )
+{
+  if ( inputData_.usingCallback ) {
+    errorString_ = "MidiInApi::setBatchCallback: a callback function is already set!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  if ( !callback ) {
+    errorString_ = "RtMidiIn::setBatchCallback: callback function value is invalid!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  // The input thread must not allocate the array of the messages.
+  inputData_.batch.resize( inputData_.queue.ringSize );
+  inputData_.batchCallback = (void *) callback;
+  inputData_.batchUserData = userData;
+  inputData_.userCallback = (void *) batchAdapter;
+  inputData_.userData = &inputData_;
+  inputData_.usingBatch = true;
+  inputData_.usingCallback = true;
+}
+
 void MidiInApi :: cancelCallback()
 {
   if ( !inputData_.usingCallback ) {
@@ -280,9 +359,47 @@ void MidiInApi :: cancelCallback()
     return;
   }
 
+  inputData_.usingCallback = false;
+  inputData_.usingBatch = false;
   inputData_.userCallback = 0;
+  inputData_.batchCallback = 0;
+
+  // Wait until the input thread has left the callback (unless we are
+  // called by the callback itself): then it won't be called again.
+  if ( CallbackGuard::current != &inputData_ )
+    while ( inputData_.callbackBusy.load() ) std::this_thread::yield();
   inputData_.userData = 0;
-  inputData_.usingCallback = false;
+  inputData_.batchUserData = 0;
+}
+
+thread_local MidiInApi::RtMidiInData *MidiInApi::CallbackGuard::current = 0;
+
+void MidiInApi :: callUserCallback( RtMidiInData *data, double timeStamp, std::vector<unsigned char> *message )
+{
+  CallbackGuard guard( data );
+  RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback.load();
+  if ( callback )
+    callback( timeStamp, message, data->userData );
+}
+
+void MidiInApi :: dispatchBatch( RtMidiInData *data )
+{
+  MidiQueue &queue = data->queue;
+  unsigned int n = queue.count();
+  if ( n == 0 ) return;
+  CallbackGuard guard( data );
+  RtMidiIn::RtMidiBatchCallback callback = (RtMidiIn::RtMidiBatchCallback) data->batchCallback.load();
+  if ( !callback ) return;
+  if ( data->batch.size() < n ) data->batch.resize( n );
+  for ( unsigned int i=0; i<n; i++ ) {
+    const MidiQueue::Slot *slot = queue.peek( i );
+    RtMidiIn::BatchMessage &m = data->batch[i];
+    m.timeStamp = slot->timeStamp;
+    m.bytes = queue.data( slot );
+    m.size = slot->size;
+  }
+  callback( &data->batch[0], n, data->batchUserData );
+  for ( unsigned int i=0; i<n; i++ ) queue.pop();
 }
 
 void MidiInApi :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense )
@@ -303,16 +420,37 @@ double MidiInApi :: getMessage( std::vector<unsigned char> *message )
     return 0.0;
   }
 
-  if ( inputData_.queue.size == 0 ) return 0.0;
+  const MidiQueue::Slot *slot = inputData_.queue.peek();
+  if ( slot == 0 ) return 0.0;
 
   // Copy queued message to the vector pointer argument and then "pop" it.
-  std::vector<unsigned char> *bytes = &(inputData_.queue.ring[inputData_.queue.front].bytes);
-  message->assign( bytes->begin(), bytes->end() );
-  double deltaTime = inputData_.queue.ring[inputData_.queue.front].timeStamp;
-  inputData_.queue.size--;
-  inputData_.queue.front++;
-  if ( inputData_.queue.front == inputData_.queue.ringSize )
-    inputData_.queue.front = 0;
+  const unsigned char *bytes = inputData_.queue.data( slot );
+  message->assign( bytes, bytes + slot->size );
+  double deltaTime = slot->timeStamp;
+  inputData_.queue.pop();
+
+  return deltaTime;
+}
+
+double MidiInApi :: getMessage( unsigned char *buffer, unsigned int *size )
+{
+  unsigned int bufferSize = *size;
+  *size = 0;
+
+  if ( inputData_.usingCallback ) {
+    errorString_ = "RtMidiIn::getNextMessage: a user callback is currently set for this port.";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return 0.0;
+  }
+
+  const MidiQueue::Slot *slot = inputData_.queue.peek();
+  if ( slot == 0 ) return 0.0;
+
+  *size = slot->size;
+  if ( slot->size > bufferSize ) return 0.0;   // left in the queue
+  memcpy( buffer, inputData_.queue.data( slot ), slot->size );
+  double deltaTime = slot->timeStamp;
+  inputData_.queue.pop();
 
   return deltaTime;
 }
@@ -330,6 +468,87 @@ MidiOutApi :: ~MidiOutApi( void )
 {
 }
 
+void MidiOutApi :: sendShortMessages( const RtMidiOut::ShortMessage *messages, unsigned int count )
+{
+  // APIs without an output buffer have nothing to gain from grouping
+  // messages, so by default they are just sent one after the other.
+  for ( unsigned int i=0; i<count; ++i )
+    sendShortMessage( messages[i].status, messages[i].data1, messages[i].data2 );
+}
+
+void MidiOutApi :: scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  // APIs without output scheduling send the message at once.
+  (void) delay;
+  sendShortMessage( status, data1, data2 );
+}
+
+// Appends "#2", "#3" ... to the ids shared by more ports (identical
+// devices), in port order, so that every id is unique.
+static void makeUniqueIds( std::vector<RtMidiOut::PortInfo> &ports )
+{
+  std::vector<std::string> ids( ports.size() );
+  for ( unsigned int i=0; i<ports.size(); ++i )
+    ids[i] = ports[i].id;
+  for ( unsigned int i=1; i<ports.size(); ++i ) {
+    unsigned int n = 1;
+    for ( unsigned int j=0; j<i; ++j )
+      if ( ids[j] == ids[i] ) n++;
+    if ( n == 1 ) continue;
+    std::string id;
+    bool used;
+    do {                  // a port could have such a name
+      std::ostringstream os;
+      os << ids[i] << "#" << n++;
+      id = os.str();
+      used = false;
+      for ( unsigned int j=0; j<ports.size() && !used; ++j )
+        used = ( ids[j] == id || ( j < i && ports[j].id == id ) );
+    } while ( used );
+    ports[i].id = id;
+  }
+}
+
+void MidiOutApi :: getPortList( std::vector<RtMidiOut::PortInfo> &ports )
+{
+  // APIs without a faster way query the ports one at a time; the name
+  // is the only available identifier.
+  unsigned int nPorts = getPortCount();
+  ports.resize( nPorts );
+  for ( unsigned int i=0; i<nPorts; ++i ) {
+    ports[i].name = getPortName( i );
+    ports[i].id = ports[i].name;
+  }
+  makeUniqueIds( ports );
+}
+
+void MidiOutApi :: setPortChangeCallback( RtMidiOut::RtMidiPortChangeCallback callback, void *userData )
+{
+  // APIs without port notifications never call it.
+  (void) callback;
+  (void) userData;
+}
+
+unsigned int MidiOutApi :: shortMessageSize( unsigned char status )
+{
+  if ( status < 0x80 ) return 0;        // a data byte
+  if ( status < 0xC0 ) return 3;        // note off/on, poly pressure, control change
+  if ( status < 0xE0 ) return 2;        // program change, channel pressure
+  if ( status < 0xF0 ) return 3;        // pitch bend
+  switch ( status ) {
+  case 0xF0:                            // sysex must go through sendMessage()
+  case 0xF7:
+    return 0;
+  case 0xF1:                            // MTC quarter frame, song select
+  case 0xF3:
+    return 2;
+  case 0xF2:                            // song position pointer
+    return 3;
+  default:                              // tune request and realtime messages
+    return 1;
+  }
+}
+
 // *************************************************** //
 //
 // OS/API-specific methods.
@@ -425,18 +644,11 @@ void midiInputCallback( const MIDIPacketList *list, void *procRef, void *srcRef
       if ( !continueSysex ) {
         // If not a continuing sysex message, invoke the user callback function or queue the message.
         if ( data->usingCallback ) {
-          RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-          callback( message.timeStamp, &message.bytes, data->userData );
+          MidiInApi::callUserCallback( data, message.timeStamp, &message.bytes );
         }
         else {
-          // As long as we haven't reached our queue size limit, push the message.
-          if ( data->queue.size < data->queue.ringSize ) {
-            data->queue.ring[data->queue.back++] = message;
-            if ( data->queue.back == data->queue.ringSize )
-              data->queue.back = 0;
-            data->queue.size++;
-          }
-          else
+          // Push the message, if there is room in the queue.
+          if ( !data->queue.push( message ) )
             std::cerr << "\nMidiInCore: message queue limit reached!!\n\n";
         }
         message.bytes.clear();
@@ -489,18 +701,11 @@ void midiInputCallback( const MIDIPacketList *list, void *procRef, void *srcRef
           if ( !continueSysex ) {
             // If not a continuing sysex message, invoke the user callback function or queue the message.
             if ( data->usingCallback ) {
-              RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-              callback( message.timeStamp, &message.bytes, data->userData );
+              MidiInApi::callUserCallback( data, message.timeStamp, &message.bytes );
             }
             else {
-              // As long as we haven't reached our queue size limit, push the message.
-              if ( data->queue.size < data->queue.ringSize ) {
-                data->queue.ring[data->queue.back++] = message;
-                if ( data->queue.back == data->queue.ringSize )
-                  data->queue.back = 0;
-                data->queue.size++;
-              }
-              else
+              // Push the message, if there is room in the queue.
+              if ( !data->queue.push( message ) )
                 std::cerr << "\nMidiInCore: message queue limit reached!!\n\n";
             }
             message.bytes.clear();
@@ -954,7 +1159,6 @@ void MidiOutCore :: sendMessage( std::vector<unsigned char> *message )
 
   //  unsigned int packetBytes, bytesLeft = nBytes;
   //  unsigned int messageIndex = 0;
-  MIDITimeStamp timeStamp = AudioGetCurrentHostTime();
   CoreMidiData *data = static_cast<CoreMidiData *> (apiData_);
   OSStatus result;
 
@@ -991,9 +1195,47 @@ void MidiOutCore :: sendMessage( std::vector<unsigned char> *message )
    return;
   }
 
+  sendPacket( &message->at( 0 ), nBytes );
+}
+
+void MidiOutCore :: sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  unsigned int nBytes = shortMessageSize( status );
+  if ( nBytes == 0 ) {
+    errorString_ = "MidiOutCore::sendShortMessage: invalid status byte!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  unsigned char bytes[3] = { status, data1, data2 };
+  sendPacket( bytes, nBytes );
+}
+
+void MidiOutCore :: scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  unsigned int nBytes = shortMessageSize( status );
+  if ( nBytes == 0 ) {
+    errorString_ = "MidiOutCore::scheduleShortMessage: invalid status byte!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  unsigned char bytes[3] = { status, data1, data2 };
+  sendPacket( bytes, nBytes, delay );
+}
+
+void MidiOutCore :: sendPacket( const unsigned char *bytes, unsigned int nBytes, double delay )
+{
+  // CoreMIDI delivers packets with a future timestamp by itself.
+  MIDITimeStamp timeStamp = AudioGetCurrentHostTime();
+  if ( delay > 0.0 )
+    timeStamp += AudioConvertNanosToHostTime( (UInt64) ( delay * 1000000000.0 ) );
+  CoreMidiData *data = static_cast<CoreMidiData *> (apiData_);
+  OSStatus result;
+
   MIDIPacketList packetList;
   MIDIPacket *packet = MIDIPacketListInit( &packetList );
-  packet = MIDIPacketListAdd( &packetList, sizeof(packetList), packet, timeStamp, nBytes, (const Byte *) &message->at( 0 ) );
+  packet = MIDIPacketListAdd( &packetList, sizeof(packetList), packet, timeStamp, nBytes, (const Byte *) bytes );
   if ( !packet ) {
     errorString_ = "MidiOutCore::sendMessage: could not allocate packet list";      
     RtMidi::error( RtError::DRIVER_ERROR, errorString_ );
@@ -1072,7 +1314,13 @@ struct AlsaMidiData {
   pthread_t dummy_thread_id;
   unsigned long long lastTime;
   int queue_id; // an input queue is needed to get timestamped events
+                // (output uses it for scheduled events, allocated on demand)
   int trigger_fds[2];
+  snd_seq_t *monitorSeq;   // output only: a client listening to the port announcements
+  pthread_t monitorThread;
+  int monitor_fds[2];
+  RtMidiOut::RtMidiPortChangeCallback portChangeCallback;
+  void *portChangeUserData;
 };
 
 #define PORT_TYPE( pinfo, bits ) ((snd_seq_port_info_get_capability(pinfo) & (bits)) == (bits))
@@ -1156,7 +1404,8 @@ extern "C" void *alsaMidiHandler( void *ptr )
   while ( data->doInput ) {
 
     if ( snd_seq_event_input_pending( apiData->seq, 1 ) == 0 ) {
-      // No data pending
+      // No data pending: deliver the gathered messages, then wait.
+      if ( data->usingBatch ) MidiInApi::dispatchBatch( data );
       if ( poll( poll_fds, poll_fd_count, -1) >= 0 ) {
         if ( poll_fds[0].revents & POLLIN ) {
           bool dummy;
@@ -1277,19 +1526,20 @@ extern "C" void *alsaMidiHandler( void *ptr )
     snd_seq_free_event( ev );
     if ( message.bytes.size() == 0 || continueSysex ) continue;
 
-    if ( data->usingCallback ) {
-      RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-      callback( message.timeStamp, &message.bytes, data->userData );
+    if ( data->usingBatch ) {
+      // Gather the message: the batch is delivered when no more
+      // events are pending, or now if the queue is full.
+      if ( !data->queue.push( message ) ) {
+        MidiInApi::dispatchBatch( data );
+        data->queue.push( message );
+      }
+    }
+    else if ( data->usingCallback ) {
+      MidiInApi::callUserCallback( data, message.timeStamp, &message.bytes );
     }
     else {
-      // As long as we haven't reached our queue size limit, push the message.
-      if ( data->queue.size < data->queue.ringSize ) {
-        data->queue.ring[data->queue.back++] = message;
-        if ( data->queue.back == data->queue.ringSize )
-          data->queue.back = 0;
-        data->queue.size++;
-      }
-      else
+      // Push the message, if there is room in the queue.
+      if ( !data->queue.push( message ) )
         std::cerr << "\nMidiInAlsa: message queue limit reached!!\n\n";
     }
   }
@@ -1644,6 +1894,16 @@ MidiOutAlsa :: ~MidiOutAlsa()
   // Cleanup.
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
   if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
+  if ( data->queue_id >= 0 ) snd_seq_free_queue( data->seq, data->queue_id );
+  if ( data->monitorSeq ) {
+    // Shutdown the port monitor thread.
+    int res = write( data->monitor_fds[1], &data->monitorSeq, 1 );
+    (void) res;
+    pthread_join( data->monitorThread, NULL );
+    close( data->monitor_fds[0] );
+    close( data->monitor_fds[1] );
+    snd_seq_close( data->monitorSeq );
+  }
   if ( data->coder ) snd_midi_event_free( data->coder );
   if ( data->buffer ) free( data->buffer );
   freeSequencer();
@@ -1664,6 +1924,10 @@ void MidiOutAlsa :: initialize( const std::string& clientName )
   data->seq = seq;
   data->portNum = -1;
   data->vport = -1;
+  data->queue_id = -1;
+  data->monitorSeq = 0;
+  data->portChangeCallback = 0;
+  data->portChangeUserData = 0;
   data->bufferSize = 32;
   data->coder = 0;
   data->buffer = 0;
@@ -1719,6 +1983,131 @@ std::string MidiOutAlsa :: getPortName( unsigned int portNumber )
   return stringName;
 }
 
+void MidiOutAlsa :: getPortList( std::vector<RtMidiOut::PortInfo> &ports )
+{
+  // Same enumeration as portInfo(), in a single pass.
+  snd_seq_client_info_t *cinfo;
+  snd_seq_port_info_t *pinfo;
+  snd_seq_client_info_alloca( &cinfo );
+  snd_seq_port_info_alloca( &pinfo );
+  unsigned int type = SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE;
+
+  ports.clear();
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  snd_seq_client_info_set_client( cinfo, -1 );
+  while ( snd_seq_query_next_client( data->seq, cinfo ) >= 0 ) {
+    int client = snd_seq_client_info_get_client( cinfo );
+    if ( client == 0 ) continue;
+    snd_seq_port_info_set_client( pinfo, client );
+    snd_seq_port_info_set_port( pinfo, -1 );
+    while ( snd_seq_query_next_port( data->seq, pinfo ) >= 0 ) {
+      unsigned int atyp = snd_seq_port_info_get_type( pinfo );
+      if ( ( atyp & SND_SEQ_PORT_TYPE_MIDI_GENERIC ) == 0 ) continue;
+      unsigned int caps = snd_seq_port_info_get_capability( pinfo );
+      if ( ( caps & type ) != type ) continue;
+
+      // The client number can change when a device is plugged again,
+      // while the client and port names don't.
+      RtMidiOut::PortInfo info;
+      std::ostringstream os;
+      os << snd_seq_client_info_get_name( cinfo ) << ":" << snd_seq_port_info_get_port( pinfo );
+      info.name = os.str();
+      info.id = snd_seq_client_info_get_name( cinfo );
+      info.id += ":";
+      info.id += snd_seq_port_info_get_name( pinfo );
+      ports.push_back( info );
+    }
+  }
+  makeUniqueIds( ports );
+}
+
+// The port monitor thread: it waits for the announcements of the
+// System:Announce port and calls the user callback when ports appear,
+// disappear or change.
+extern "C" void *alsaPortMonitor( void *ptr )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (ptr);
+  int poll_fd_count = snd_seq_poll_descriptors_count( data->monitorSeq, POLLIN ) + 1;
+  struct pollfd *poll_fds = (struct pollfd*)alloca( poll_fd_count * sizeof( struct pollfd ));
+  snd_seq_poll_descriptors( data->monitorSeq, poll_fds + 1, poll_fd_count - 1, POLLIN );
+  poll_fds[0].fd = data->monitor_fds[0];
+  poll_fds[0].events = POLLIN;
+
+  for ( ;; ) {
+    if ( poll( poll_fds, poll_fd_count, -1 ) < 0 ) {
+      if ( errno == EINTR ) continue;
+      break;
+    }
+    if ( poll_fds[0].revents & POLLIN ) break;  // the output object is being destroyed
+
+    bool changed = false;
+    snd_seq_event_t *ev;
+    for ( ;; ) {
+      int result = snd_seq_event_input( data->monitorSeq, &ev );
+      if ( result == -ENOSPC ) {   // some announcements were lost
+        changed = true;
+        continue;
+      }
+      if ( result < 0 ) break;     // no more events
+      switch ( ev->type ) {
+      case SND_SEQ_EVENT_PORT_START:
+      case SND_SEQ_EVENT_PORT_EXIT:
+      case SND_SEQ_EVENT_PORT_CHANGE:
+      case SND_SEQ_EVENT_CLIENT_START:
+      case SND_SEQ_EVENT_CLIENT_EXIT:
+      case SND_SEQ_EVENT_CLIENT_CHANGE:
+        changed = true;
+        break;
+      default:
+        break;
+      }
+      snd_seq_free_event( ev );
+    }
+    RtMidiOut::RtMidiPortChangeCallback callback = data->portChangeCallback;
+    if ( changed && callback ) callback( data->portChangeUserData );
+  }
+  return 0;
+}
+
+void MidiOutAlsa :: setPortChangeCallback( RtMidiOut::RtMidiPortChangeCallback callback, void *userData )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  data->portChangeUserData = userData;
+  data->portChangeCallback = callback;
+  if ( callback == 0 || data->monitorSeq ) return;
+
+  // The announcements are read by a separate client, so that they don't
+  // mix with the events of the shared sequencer (used for input).
+  snd_seq_t *seq;
+  if ( snd_seq_open( &seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK ) < 0 ) {
+    errorString_ = "MidiOutAlsa::setPortChangeCallback: error creating ALSA sequencer client object.";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+  snd_seq_set_client_name( seq, "RtMidi Port Monitor" );
+  int port = snd_seq_create_simple_port( seq, "Announce",
+                                         SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_NO_EXPORT,
+                                         SND_SEQ_PORT_TYPE_APPLICATION );
+  if ( port < 0 ||
+       snd_seq_connect_from( seq, port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE ) < 0 ||
+       pipe( data->monitor_fds ) == -1 ) {
+    snd_seq_close( seq );
+    errorString_ = "MidiOutAlsa::setPortChangeCallback: error connecting to the ALSA announce port.";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  data->monitorSeq = seq;
+  if ( pthread_create( &data->monitorThread, NULL, alsaPortMonitor, data ) ) {
+    close( data->monitor_fds[0] );
+    close( data->monitor_fds[1] );
+    snd_seq_close( seq );
+    data->monitorSeq = 0;
+    errorString_ = "MidiOutAlsa::setPortChangeCallback: error starting the port monitor thread!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+  }
+}
+
 void MidiOutAlsa :: openPort( unsigned int portNumber, const std::string portName )
 {
   if ( connected_ ) {
@@ -1846,6 +2235,108 @@ void MidiOutAlsa :: sendMessage( std::vector<unsigned char> *message )
   snd_seq_drain_output(data->seq);
 }
 
+// Encodes a short message into a direct event for our output port.
+// The bytes live on the stack and are encoded straight into the event,
+// so the coder buffer never needs to be resized here.
+static bool encodeShortEvent( AlsaMidiData *data, unsigned char status, unsigned char data1,
+                              unsigned char data2, snd_seq_event_t *ev )
+{
+  long nBytes = MidiOutApi::shortMessageSize( status );
+  if ( nBytes == 0 ) return false;
+
+  unsigned char bytes[3] = { status, data1, data2 };
+  snd_seq_ev_clear(ev);
+  snd_seq_ev_set_source(ev, data->vport);
+  snd_seq_ev_set_subs(ev);
+  snd_seq_ev_set_direct(ev);
+  return snd_midi_event_encode( data->coder, bytes, nBytes, ev ) >= nBytes;
+}
+
+void MidiOutAlsa :: sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  snd_seq_event_t ev;
+  if ( !encodeShortEvent( data, status, data1, data2, &ev ) ) {
+    errorString_ = "MidiOutAlsa::sendShortMessage: event parsing error!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  // Send the event.
+  if ( snd_seq_event_output(data->seq, &ev) < 0 ) {
+    errorString_ = "MidiOutAlsa::sendShortMessage: error sending MIDI message to port.";
+    RtMidi::error( RtError::WARNING, errorString_ );
+  }
+  snd_seq_drain_output(data->seq);
+}
+
+void MidiOutAlsa :: sendShortMessages( const RtMidiOut::ShortMessage *messages, unsigned int count )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  snd_seq_event_t ev;
+  for ( unsigned int i=0; i<count; ++i ) {
+    if ( !encodeShortEvent( data, messages[i].status, messages[i].data1, messages[i].data2, &ev ) ) {
+      errorString_ = "MidiOutAlsa::sendShortMessages: event parsing error!";
+      RtMidi::error( RtError::WARNING, errorString_ );
+      continue;
+    }
+
+    // Only queue the event in the library buffer: it is drained once
+    // below, unless the buffer fills up before the end of the group.
+    int result = snd_seq_event_output_buffer(data->seq, &ev);
+    if ( result == -EAGAIN ) {
+      snd_seq_drain_output(data->seq);
+      result = snd_seq_event_output_buffer(data->seq, &ev);
+    }
+    if ( result < 0 ) {
+      errorString_ = "MidiOutAlsa::sendShortMessages: error sending MIDI message to port.";
+      RtMidi::error( RtError::WARNING, errorString_ );
+    }
+  }
+  snd_seq_drain_output(data->seq);
+}
+
+void MidiOutAlsa :: scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  if ( delay <= 0.0 ) {
+    sendShortMessage( status, data1, data2 );
+    return;
+  }
+
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->queue_id < 0 ) {
+    // Create and start the output queue the first time it is needed.
+    data->queue_id = snd_seq_alloc_named_queue( data->seq, "RtMidi Out Queue" );
+    if ( data->queue_id < 0 ) {
+      errorString_ = "MidiOutAlsa::scheduleShortMessage: ALSA error allocating the output queue.";
+      RtMidi::error( RtError::WARNING, errorString_ );
+      sendShortMessage( status, data1, data2 );
+      return;
+    }
+    snd_seq_start_queue( data->seq, data->queue_id, NULL );
+  }
+
+  snd_seq_event_t ev;
+  if ( !encodeShortEvent( data, status, data1, data2, &ev ) ) {
+    errorString_ = "MidiOutAlsa::scheduleShortMessage: event parsing error!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  // The event is scheduled in real time, relative to the current queue
+  // time, so the queue needs no synchronization with any other clock.
+  snd_seq_real_time_t rt;
+  rt.tv_sec = (unsigned int) delay;
+  rt.tv_nsec = (unsigned int) ( ( delay - rt.tv_sec ) * 1000000000.0 );
+  snd_seq_ev_schedule_real( &ev, data->queue_id, 1, &rt );
+
+  if ( snd_seq_event_output(data->seq, &ev) < 0 ) {
+    errorString_ = "MidiOutAlsa::scheduleShortMessage: error sending MIDI message to port.";
+    RtMidi::error( RtError::WARNING, errorString_ );
+  }
+  snd_seq_drain_output(data->seq);
+}
+
 #endif // __LINUX_ALSA__
 
 
@@ -1964,18 +2455,11 @@ static void CALLBACK midiInputCallback( HMIDIIN hmin,
   }
 
   if ( data->usingCallback ) {
-    RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
-    callback( apiData->message.timeStamp, &apiData->message.bytes, data->userData );
+    MidiInApi::callUserCallback( data, apiData->message.timeStamp, &apiData->message.bytes );
   }
   else {
-    // As long as we haven't reached our queue size limit, push the message.
-    if ( data->queue.size < data->queue.ringSize ) {
-      data->queue.ring[data->queue.back++] = apiData->message;
-      if ( data->queue.back == data->queue.ringSize )
-        data->queue.back = 0;
-      data->queue.size++;
-    }
-    else
+    // Push the message, if there is room in the queue.
+    if ( !data->queue.push( apiData->message ) )
       std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
   }
 
@@ -2344,6 +2828,25 @@ void MidiOutWinMM :: sendMessage( std::vector<unsigned char> *message )
   }
 }
 
+void MidiOutWinMM :: sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  if ( shortMessageSize( status ) == 0 ) {
+    errorString_ = "MidiOutWinMM::sendShortMessage: invalid status byte!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  // midiOutShortMsg() takes the bytes packed in a double word and
+  // ignores the ones not needed by the status.
+  WinMidiData *data = static_cast<WinMidiData *> (apiData_);
+  DWORD packet = (DWORD) status | ( (DWORD) data1 << 8 ) | ( (DWORD) data2 << 16 );
+  MMRESULT result = midiOutShortMsg( data->outHandle, packet );
+  if ( result != MMSYSERR_NOERROR ) {
+    errorString_ = "MidiOutWinMM::sendShortMessage: error sending MIDI message.";
+    RtMidi::error( RtError::DRIVER_ERROR, errorString_ );
+  }
+}
+
 #endif  // __WINDOWS_MM__
 
 // *********************************************************************//
@@ -3084,18 +3587,11 @@ DWORD WINAPI midiKsInputThread(VOID* pUser)
           message.bytes.push_back(pData[iOffset+i]);
 
         if ( data->usingCallback ) {
-          RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback)data->userCallback;
-          callback(message.timeStamp, &message.bytes, data->userData);
+          MidiInApi::callUserCallback( data, message.timeStamp, &message.bytes );
         }
         else {
-          // As long as we haven't reached our queue size limit, push the message.
-          if ( data->queue.size < data->queue.ringSize ) {
-            data->queue.ring[data->queue.back++] = message;
-            if(data->queue.back == data->queue.ringSize)
-              data->queue.back = 0;
-            data->queue.size++;
-          }
-          else
+          // Push the message, if there is room in the queue.
+          if ( !data->queue.push( message ) )
             std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
         }
 
@@ -3330,8 +3826,25 @@ void MidiOutWinKS :: closePort()
 void MidiOutWinKS :: sendMessage(std::vector<unsigned char>* pMessage)
 {
   std::vector<unsigned char> const& msg = *pMessage;
+  writeBytes(&msg[0], msg.size());
+}
+
+void MidiOutWinKS :: sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  size_t iNumMidiBytes = shortMessageSize( status );
+  if ( iNumMidiBytes == 0 ) {
+    errorString_ = "MidiOutWinKS::sendShortMessage: invalid status byte!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  unsigned char bytes[3] = { status, data1, data2 };
+  writeBytes(bytes, iNumMidiBytes);
+}
+
+void MidiOutWinKS :: writeBytes(const unsigned char* pBytes, size_t iNumMidiBytes)
+{
   WindowsKsData* data = static_cast<WindowsKsData*>(apiData_);
-  size_t iNumMidiBytes = msg.size();
   size_t pos = 0;
 
   // write header
@@ -3355,7 +3868,7 @@ void MidiOutWinKS :: sendMessage(std::vector<unsigned char>* pMessage)
     RtMidi::error( RtError::WARNING, errorString_ );
   }
 
-  memcpy(&data->m_Buffer[pos], &msg[0], iNumMidiBytes);
+  memcpy(&data->m_Buffer[pos], pBytes, iNumMidiBytes);
   pos += iNumMidiBytes;
 
   KSSTREAM_HEADER packet;
@@ -3387,16 +3900,41 @@ void MidiOutWinKS :: sendMessage(std::vector<unsigned char>* pMessage)
 #include <jack/jack.h>
 #include <jack/midiport.h>
 #include <jack/ringbuffer.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#define JACK_SCHEDULE_SIZE 256      // Max number of messages waiting for their cycle
+
+// The header of a message in the output ringbuffer, followed by its bytes.
+struct JackMessageHeader {
+  jack_nframes_t time;  // absolute frame time of the message
+  unsigned int size;
+};
 
-#define JACK_RINGBUFFER_SIZE 16384 // Default size for ringbuffer
+// A short message waiting for its cycle: the frame time and the bytes.
+struct JackScheduledEvent {
+  jack_nframes_t time;
+  unsigned char size;
+  unsigned char bytes[3];
+};
 
 struct JackMidiData {
   jack_client_t *client;
   jack_port_t *port;
-  jack_ringbuffer_t *buffSize;
-  jack_ringbuffer_t *buffMessage;
-  jack_time_t lastTime;
+  jack_ringbuffer_t *buffer;         // output messages (header and bytes)
+  JackScheduledEvent *pending;       // short messages waiting for their
+  unsigned int nPending;             // cycle (process thread only), by time
+  RtMidiOut::RtMidiPortChangeCallback portChangeCallback;
+  void *portChangeUserData;
+  jack_nframes_t lastFrame;          // input: frame time of the last message
   MidiInApi :: RtMidiInData *rtMidiIn;
+  pthread_t dispatcher;              // input: calls the user callback
+  sem_t dispatchSem;                 // posted by the process thread
+  bool dispatching;                  // false stops the dispatcher
+  bool dispatcherStarted;            // the dispatcher and dispatchSem exist
+  std::atomic<unsigned long> overflows; // input: messages not queued
   };
 
 //*********************************************************************//
@@ -3404,12 +3942,14 @@ struct JackMidiData {
 //  Class Definitions: MidiInJack
 //*********************************************************************//
 
+// The process callback runs in the JACK real-time thread, so it only
+// copies the events into the preallocated queue.  With a user callback
+// the queue is drained by the dispatcher thread, which calls it.
 int jackProcessIn( jack_nframes_t nframes, void *arg )
 {
   JackMidiData *jData = (JackMidiData *) arg;
   MidiInApi :: RtMidiInData *rtData = jData->rtMidiIn;
   jack_midi_event_t event;
-  jack_time_t long long time;
 
   // Is port created?
   if ( jData->port == NULL ) return 0;
@@ -3417,43 +3957,78 @@ int jackProcessIn( jack_nframes_t nframes, void *arg )
 
   // We have midi events in buffer
   int evCount = jack_midi_get_event_count( buff );
-  if ( evCount > 0 ) {
-    MidiInApi::MidiMessage message;
-    message.bytes.clear();
-
-    jack_midi_event_get( &event, buff, 0 );
+  if ( evCount == 0 ) return 0;
 
-    for (unsigned int i = 0; i < event.size; i++ )
-      message.bytes.push_back( event.buffer[i] );
+  jack_nframes_t cycleStart = jack_last_frame_time( jData->client );
+  double rate = jack_get_sample_rate( jData->client );
+  bool pushed = false, dropped = false;
+  for ( int i=0; i<evCount; i++ ) {
+    if ( jack_midi_event_get( &event, buff, i ) != 0 ) continue;
 
-    // Compute the delta time.
-    time = jack_get_time();
+    // Compute the delta time from the frame of the event.
+    jack_nframes_t frame = cycleStart + event.time;
+    double timeStamp = 0.0;
     if ( rtData->firstMessage == true )
       rtData->firstMessage = false;
     else
-      message.timeStamp = ( time - jData->lastTime ) * 0.000001;
+      timeStamp = (jack_nframes_t) ( frame - jData->lastFrame ) / rate;
 
-    jData->lastTime = time;
+    jData->lastFrame = frame;
 
-    if ( !rtData->continueSysex ) {
-      if ( rtData->usingCallback ) {
-        RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) rtData->userCallback;
-        callback( message.timeStamp, &message.bytes, rtData->userData );
-      }
-      else {
-        // As long as we haven't reached our queue size limit, push the message.
-        if ( rtData->queue.size < rtData->queue.ringSize ) {
-          rtData->queue.ring[rtData->queue.back++] = message;
-          if ( rtData->queue.back == rtData->queue.ringSize )
-            rtData->queue.back = 0;
-          rtData->queue.size++;
-        }
-        else
-          std::cerr << "\nMidiInJack: message queue limit reached!!\n\n";
-      }
+    // Push the message, if there is room in the queue.
+    // Printing here could block, so the dispatcher reports the overflows.
+    if ( rtData->queue.push( event.buffer, event.size, timeStamp ) )
+      pushed = true;
+    else {
+      jData->overflows.fetch_add( 1, std::memory_order_relaxed );
+      dropped = true;
     }
   }
 
+  if ( ( pushed && rtData->usingCallback ) || dropped )
+    sem_post( &jData->dispatchSem );      // a single wakeup for the whole cycle
+
+  return 0;
+}
+
+void *jackInputDispatcher( void *arg )
+{
+  JackMidiData *jData = (JackMidiData *) arg;
+  MidiInApi :: RtMidiInData *rtData = jData->rtMidiIn;
+  MidiInApi :: MidiQueue &queue = rtData->queue;
+
+  // The message is reused, so its vector allocates only when it grows.
+  MidiInApi::MidiMessage &message = rtData->message;
+
+  for ( ;; ) {
+    if ( sem_wait( &jData->dispatchSem ) != 0 ) {
+      if ( errno == EINTR ) continue;
+      break;
+    }
+    if ( !jData->dispatching ) break;
+
+    unsigned long dropped = jData->overflows.exchange( 0, std::memory_order_relaxed );
+    if ( dropped )
+      std::cerr << "\nMidiInJack: message queue limit reached (" << dropped << " messages dropped)!!\n\n";
+
+    if ( rtData->usingBatch ) {
+      MidiInApi::dispatchBatch( rtData );
+      continue;
+    }
+    const MidiInApi::MidiQueue::Slot *slot;
+    while ( rtData->usingCallback && ( slot = queue.peek() ) != 0 ) {
+      // The message is popped only if the callback is still set (else it
+      // stays for getMessage()).
+      MidiInApi::CallbackGuard guard( rtData );
+      RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) rtData->userCallback.load();
+      if ( !callback ) break;
+      const unsigned char *bytes = queue.data( slot );
+      message.bytes.assign( bytes, bytes + slot->size );
+      message.timeStamp = slot->timeStamp;
+      queue.pop();
+      callback( message.timeStamp, &message.bytes, rtData->userData );
+    }
+  }
   return 0;
 }
 
@@ -3467,6 +4042,14 @@ void MidiInJack :: initialize( const std::string& clientName )
   JackMidiData *data = new JackMidiData;
   apiData_ = (void *) data;
 
+  // The destructor frees only what was created.
+  data->rtMidiIn = &inputData_;
+  data->port = NULL;
+  data->lastFrame = 0;
+  data->dispatching = false;
+  data->dispatcherStarted = false;
+  data->overflows = 0;
+
   // Initialize JACK client
   if (( data->client = jack_client_open( clientName.c_str(), JackNullOption, NULL )) == 0) {
     errorString_ = "MidiInJack::initialize: JACK server not running?";
@@ -3474,8 +4057,18 @@ void MidiInJack :: initialize( const std::string& clientName )
     return;
   }
 
-  data->rtMidiIn = &inputData_;
-  data->port = NULL;
+  // Start the thread which calls the user callback.
+  sem_init( &data->dispatchSem, 0, 0 );
+  data->dispatching = true;
+  if ( pthread_create( &data->dispatcher, NULL, jackInputDispatcher, data ) ) {
+    sem_destroy( &data->dispatchSem );
+    jack_client_close( data->client );
+    data->client = 0;
+    errorString_ = "MidiInJack::initialize: error creating the callback thread!";
+    RtMidi::error( RtError::THREAD_ERROR, errorString_ );
+    return;
+  }
+  data->dispatcherStarted = true;
 
   jack_set_process_callback( data->client, jackProcessIn, data );
   jack_activate( data->client );
@@ -3486,7 +4079,16 @@ MidiInJack :: ~MidiInJack()
   JackMidiData *data = static_cast<JackMidiData *> (apiData_);
   closePort();
 
-  jack_client_close( data->client );
+  if ( data->client )
+    jack_client_close( data->client );
+
+  // Stop the dispatcher (the process callback has been stopped).
+  if ( data->dispatcherStarted ) {
+    data->dispatching = false;
+    sem_post( &data->dispatchSem );
+    pthread_join( data->dispatcher, NULL );
+    sem_destroy( &data->dispatchSem );
+  }
 }
 
 void MidiInJack :: openPort( unsigned int portNumber, const std::string portName )
@@ -3582,12 +4184,43 @@ void MidiInJack :: closePort()
 //  Class Definitions: MidiOutJack
 //*********************************************************************//
 
+// Writes to the port buffer the pending messages with an offset lower
+// than 'end' in the current cycle. JACK wants the events in time order,
+// so no message goes before the last one written (late messages go at
+// the beginning of the cycle).
+static void jackWritePending( JackMidiData *data, void *buff, jack_nframes_t start, int end,
+                              jack_nframes_t *last )
+{
+  unsigned int nDue = 0;
+  while ( nDue < data->nPending ) {
+    int offset = (int) ( data->pending[nDue].time - start );
+    if ( offset >= end ) break;
+    if ( offset < (int) *last ) offset = *last;
+    jack_midi_event_write( buff, (jack_nframes_t) offset, data->pending[nDue].bytes,
+                           data->pending[nDue].size );
+    *last = offset;
+    nDue++;
+  }
+  if ( nDue > 0 ) {
+    data->nPending -= nDue;
+    memmove( data->pending, data->pending + nDue, data->nPending * sizeof(JackScheduledEvent) );
+  }
+}
+
+// Jack port registration callback
+void jackPortRegistration( jack_port_id_t, int, void *arg )
+{
+  JackMidiData *data = (JackMidiData *) arg;
+  RtMidiOut::RtMidiPortChangeCallback callback = data->portChangeCallback;
+  if ( callback ) callback( data->portChangeUserData );
+}
+
 // Jack process callback
 int jackProcessOut( jack_nframes_t nframes, void *arg )
 {
   JackMidiData *data = (JackMidiData *) arg;
+  JackMessageHeader header;
   jack_midi_data_t *midiData;
-  int space;
 
   // Is port created?
   if ( data->port == NULL ) return 0;
@@ -3595,18 +4228,53 @@ int jackProcessOut( jack_nframes_t nframes, void *arg )
   void *buff = jack_port_get_buffer( data->port, nframes );
   jack_midi_clear_buffer( buff );
 
-  while ( jack_ringbuffer_read_space( data->buffSize ) > 0 ) {
-    jack_ringbuffer_read( data->buffSize, (char *) &space, (size_t) sizeof(space) );
-    midiData = jack_midi_event_reserve( buff, 0, space );
+  jack_nframes_t start = jack_last_frame_time( data->client );
+  jack_nframes_t last = 0;
+  while ( jack_ringbuffer_peek( data->buffer, (char *) &header, sizeof(header) ) == sizeof(header) ) {
+    // The writer publishes whole messages, so this is only a safety check.
+    if ( jack_ringbuffer_read_space( data->buffer ) < sizeof(header) + header.size ) break;
+
+    if ( header.size <= 3 && data->nPending < JACK_SCHEDULE_SIZE ) {
+      // Short messages are merged with the pending ones, sorted by time
+      // (the frame times wrap around, so they are compared by difference).
+      JackScheduledEvent event;
+      event.time = header.time;
+      event.size = (unsigned char) header.size;
+      jack_ringbuffer_read_advance( data->buffer, sizeof(header) );
+      if ( jack_ringbuffer_read( data->buffer, (char *) event.bytes, header.size ) != header.size ) break;
+      unsigned int i = data->nPending++;
+      while ( i > 0 && (int) ( event.time - data->pending[i-1].time ) < 0 ) {
+        data->pending[i] = data->pending[i-1];
+        i--;
+      }
+      data->pending[i] = event;
+      continue;
+    }
 
-    jack_ringbuffer_read( data->buffMessage, (char *) midiData, (size_t) space );
+    // Sysex messages (and short ones, if the pending list is full) are
+    // written directly, after the pending messages which come before
+    // them. A message for a later cycle is left in the ringbuffer.
+    int offset = (int) ( header.time - start );
+    if ( offset >= (int) nframes ) break;
+    jackWritePending( data, buff, start, offset + 1, &last );
+    if ( offset < (int) last ) offset = last;
+    jack_ringbuffer_read_advance( data->buffer, sizeof(header) );
+    midiData = jack_midi_event_reserve( buff, (jack_nframes_t) offset, header.size );
+    if ( midiData == NULL ) {     // no room in the port buffer: the message is lost
+      jack_ringbuffer_read_advance( data->buffer, header.size );
+      continue;
+    }
+    if ( jack_ringbuffer_read( data->buffer, (char *) midiData, header.size ) != header.size ) break;
+    last = offset;
   }
 
+  jackWritePending( data, buff, start, (int) nframes, &last );
   return 0;
 }
 
-MidiOutJack :: MidiOutJack( const std::string clientName ) : MidiOutApi()
+MidiOutJack :: MidiOutJack( const std::string clientName, unsigned int bufferSize ) : MidiOutApi()
 {
+  bufferSize_ = bufferSize;
   initialize( clientName );
 }
 
@@ -3623,9 +4291,13 @@ void MidiOutJack :: initialize( const std::string& clientName )
     return;
   }
 
+  data->portChangeCallback = 0;
+  data->portChangeUserData = 0;
   jack_set_process_callback( data->client, jackProcessOut, data );
-  data->buffSize = jack_ringbuffer_create( JACK_RINGBUFFER_SIZE );
-  data->buffMessage = jack_ringbuffer_create( JACK_RINGBUFFER_SIZE );
+  jack_set_port_registration_callback( data->client, jackPortRegistration, data );
+  data->buffer = jack_ringbuffer_create( bufferSize_ );
+  data->pending = new JackScheduledEvent[JACK_SCHEDULE_SIZE];
+  data->nPending = 0;
   jack_activate( data->client );
 
   apiData_ = (void *) data;
@@ -3638,8 +4310,8 @@ MidiOutJack :: ~MidiOutJack()
 
   // Cleanup
   jack_client_close( data->client );
-  jack_ringbuffer_free( data->buffSize );
-  jack_ringbuffer_free( data->buffMessage );
+  jack_ringbuffer_free( data->buffer );
+  delete [] data->pending;
 
   delete data;
 }
@@ -3724,6 +4396,32 @@ std::string MidiOutJack :: getPortName( unsigned int portNumber )
   return retStr;
 }
 
+void MidiOutJack :: getPortList( std::vector<RtMidiOut::PortInfo> &ports )
+{
+  JackMidiData *data = static_cast<JackMidiData *> (apiData_);
+  ports.clear();
+
+  // List of available ports (JACK port names are unique and stable)
+  const char **names = jack_get_ports( data->client, NULL,
+    JACK_DEFAULT_MIDI_TYPE, JackPortIsInput );
+  if ( names == NULL ) return;
+
+  for ( unsigned int i=0; names[i] != NULL; ++i ) {
+    RtMidiOut::PortInfo info;
+    info.name = names[i];
+    info.id = names[i];
+    ports.push_back( info );
+  }
+  free( names );
+}
+
+void MidiOutJack :: setPortChangeCallback( RtMidiOut::RtMidiPortChangeCallback callback, void *userData )
+{
+  JackMidiData *data = static_cast<JackMidiData *> (apiData_);
+  data->portChangeUserData = userData;
+  data->portChangeCallback = callback;
+}
+
 void MidiOutJack :: closePort()
 {
   JackMidiData *data = static_cast<JackMidiData *> (apiData_);
@@ -3733,15 +4431,81 @@ void MidiOutJack :: closePort()
   data->port = NULL;
 }
 
+// Writes a whole message (header and bytes) to the output ringbuffer.
+// The write pointer is advanced only at the end, so the process callback
+// never sees a partial message.
+static bool jackWriteMessage( JackMidiData *data, double delay, const unsigned char *bytes, unsigned int nBytes )
+{
+  // The frame currently played will be in the past when the process
+  // callback sees the message, so the time is counted from the next
+  // cycle: this adds a constant latency of one period, but every
+  // message is placed at its exact frame.
+  JackMessageHeader header;
+  header.time = jack_frame_time( data->client ) + jack_get_buffer_size( data->client );
+  if ( delay > 0.0 )
+    header.time += (jack_nframes_t) ( delay * jack_get_sample_rate( data->client ) + 0.5 );
+  header.size = nBytes;
+
+  jack_ringbuffer_data_t vec[2];
+  jack_ringbuffer_get_write_vector( data->buffer, vec );
+  if ( vec[0].len + vec[1].len < sizeof(header) + nBytes ) return false;
+
+  const char *src[2] = { (const char *) &header, (const char *) bytes };
+  size_t len[2] = { sizeof(header), nBytes };
+  unsigned int v = 0;
+  size_t pos = 0;
+  for ( unsigned int i=0; i<2; ++i ) {
+    while ( len[i] > 0 ) {
+      if ( pos == vec[v].len ) {
+        v++;
+        pos = 0;
+      }
+      size_t n = vec[v].len - pos < len[i] ? vec[v].len - pos : len[i];
+      memcpy( vec[v].buf + pos, src[i], n );
+      pos += n;
+      src[i] += n;
+      len[i] -= n;
+    }
+  }
+  jack_ringbuffer_write_advance( data->buffer, sizeof(header) + nBytes );
+  return true;
+}
+
 void MidiOutJack :: sendMessage( std::vector<unsigned char> *message )
 {
-  int nBytes = message->size();
   JackMidiData *data = static_cast<JackMidiData *> (apiData_);
+  if ( message->size() == 0 ) {
+    errorString_ = "MidiOutJack::sendMessage: no data in message argument!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
+
+  if ( !jackWriteMessage( data, 0.0, &( *message )[0], message->size() ) ) {
+    errorString_ = "MidiOutJack::sendMessage: output buffer full, message discarded!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+  }
+}
+
+void MidiOutJack :: sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  scheduleShortMessage( 0.0, status, data1, data2 );
+}
+
+void MidiOutJack :: scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 )
+{
+  unsigned int nBytes = shortMessageSize( status );
+  if ( nBytes == 0 ) {
+    errorString_ = "MidiOutJack::sendShortMessage: invalid status byte!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+    return;
+  }
 
-  // Write full message to buffer
-  jack_ringbuffer_write( data->buffMessage, ( const char * ) &( *message )[0],
-                         message->size() );
-  jack_ringbuffer_write( data->buffSize, ( char * ) &nBytes, sizeof( nBytes ) );
+  JackMidiData *data = static_cast<JackMidiData *> (apiData_);
+  unsigned char bytes[3] = { status, data1, data2 };
+  if ( !jackWriteMessage( data, delay, bytes, nBytes ) ) {
+    errorString_ = "MidiOutJack::sendShortMessage: output buffer full, message discarded!";
+    RtMidi::error( RtError::WARNING, errorString_ );
+  }
 }
 
 #endif  // __UNIX_JACK__
@@ -48,6 +48,7 @@
 #include "RtError.h"
 #include <string>
 #include <vector>
+#include <atomic>
 
 
 ///////////// EDITING BY N. CASSETTA
@@ -145,13 +146,25 @@ class RtMidiIn : public RtMidi
   //! User callback function type definition.
   typedef void (*RtMidiCallback)( double timeStamp, std::vector<unsigned char> *message, void *userData);
 
+  //! A MIDI message passed to the batch callback: its delta time (as for the RtMidiCallback) and its bytes.
+  struct BatchMessage {
+    double timeStamp;
+    const unsigned char *bytes;
+    unsigned int size;
+  };
+
+  //! Batch callback function type definition.
+  typedef void (*RtMidiBatchCallback)( const BatchMessage *messages, unsigned int count, void *userData );
+
   //! Default constructor that allows an optional api, client name and queue size.
   /*!
     An exception will be thrown if a MIDI system initialization
     error occurs.  The queue size defines the maximum number of
     messages that can be held in the MIDI queue (when not using a
     callback function).  If the queue size limit is reached,
-    incoming messages will be ignored.
+    incoming messages will be ignored.  With JACK the queue is used
+    with a callback too: the real-time thread only queues the
+    messages, and another thread calls the callback.
 
     If no API argument is specified and multiple API support has been
     compiled, the default order of use is JACK, ALSA (Linux) and CORE,
@@ -192,10 +205,26 @@ class RtMidiIn : public RtMidi
   */
   void setCallback( RtMidiCallback callback, void *userData = 0 );
 
+  //! Set a callback function to be invoked with groups of incoming MIDI messages.
+  /*!
+    Instead of a call for every message, the input thread gathers all
+    the messages pending when it wakes up and passes them to the
+    callback as a single array, which saves the per-message overhead
+    with high rate streams (controllers, aftertouch, clock).  The
+    messages and their bytes are valid only during the call.  A group
+    holds at most the queue size (see the constructor) messages.  The
+    ALSA and JACK APIs gather the messages, the others call the
+    callback with each message.  It is cancelled by cancelCallback().
+  */
+  void setBatchCallback( RtMidiBatchCallback callback, void *userData = 0 );
+
   //! Cancel use of the current callback function (if one exists).
   /*!
     Subsequent incoming MIDI messages will be written to the queue
-    and can be retrieved with the \e getMessage function.
+    and can be retrieved with the \e getMessage function.  If the
+    input thread is running the callback, this waits for it to return
+    (unless it is called by the callback itself), so the callback and
+    its user data are not used after this returns.
   */
   void cancelCallback();
 
@@ -231,6 +260,16 @@ class RtMidiIn : public RtMidi
   */
   double getMessage( std::vector<unsigned char> *message );
 
+  //! Fill the user-provided buffer with the data bytes for the next available MIDI message in the input queue and return the event delta-time in seconds.
+  /*!
+    Unlike the other version, this never allocates memory.  On input
+    \e size is the size of the buffer, on output the size of the
+    message (0 if no message is available).  If the buffer is too
+    small the message is not removed from the queue: \e size is set
+    to the size it needs and 0.0 is returned.
+  */
+  double getMessage( unsigned char *buffer, unsigned int *size );
+
  protected:
   void openMidiApi( RtMidi::Api api, const std::string clientName, unsigned int queueSizeLimit );
   MidiInApi *rtapi_;
@@ -257,16 +296,37 @@ class RtMidiOut : public RtMidi
 {
  public:
 
-  //! Default constructor that allows an optional client name.
+  //! A channel or system common message, as used by sendShortMessages().
+  struct ShortMessage {
+    unsigned char status;
+    unsigned char data1;
+    unsigned char data2;
+  };
+
+  //! The description of an output port, as returned by getPortList().
+  struct PortInfo {
+    std::string name;   //!< The name, as returned by getPortName()
+    std::string id;     //!< An identifier which doesn't change when other ports come and go
+  };
+
+  //! User callback function type definition for port changes (see setPortChangeCallback()).
+  typedef void (*RtMidiPortChangeCallback)( void *userData );
+
+  //! Default constructor that allows an optional client name and buffer size.
   /*!
     An exception will be thrown if a MIDI system initialization error occurs.
+    The buffer size (in bytes) is the size of the output buffer for
+    the APIs which need one (JACK, where the messages wait for the
+    next process cycle); the other APIs ignore it.  If the buffer
+    is full, outgoing messages will be discarded.
 
     If no API argument is specified and multiple API support has been
     compiled, the default order of use is JACK, ALSA (Linux) and CORE,
     Jack (OS-X).
   */
   RtMidiOut( RtMidi::Api api=UNSPECIFIED,
-             const std::string clientName = std::string( "RtMidi Output Client") );
+             const std::string clientName = std::string( "RtMidi Output Client"),
+             unsigned int bufferSize = 16384 );
 
   //! The destructor closes any open MIDI connections.
   ~RtMidiOut( void ) throw();
@@ -306,6 +366,26 @@ class RtMidiOut : public RtMidi
   */
   std::string getPortName( unsigned int portNumber = 0 );
 
+  //! Fill a vector with the description of all the available MIDI output ports.
+  /*!
+      The ports are listed in port number order, with a single
+      enumeration, so this is much faster than calling getPortName()
+      for each port.  The id of a port identifies the device even
+      when its port number changes, because other ports appeared or
+      disappeared.  Identical devices are told apart by their order:
+      "#2", "#3" ... are appended to the ids of the second, third
+      ... one.
+  */
+  void getPortList( std::vector<PortInfo> &ports );
+
+  //! Set a function to be called when MIDI output ports appear, disappear or change.
+  /*!
+      The callback is called from another thread (so it should only
+      take note of the change), and only with the APIs which notify
+      port changes (ALSA and JACK).  Pass a NULL callback to cancel it.
+  */
+  void setPortChangeCallback( RtMidiPortChangeCallback callback, void *userData = 0 );
+
   //! Immediately send a single message out an open MIDI output port.
   /*!
       An exception is thrown if an error occurs during output or an
@@ -313,8 +393,41 @@ class RtMidiOut : public RtMidi
   */
   void sendMessage( std::vector<unsigned char> *message );
 
+  //! Immediately send a single channel or system common message out an open MIDI output port.
+  /*!
+      This is a faster alternative to sendMessage() for all messages
+      but sysex: the bytes are passed by value, so no std::vector is
+      needed and no memory is allocated.  The number of data bytes
+      actually sent is deduced from the status byte, so unused data
+      bytes are ignored.  An exception is thrown if an error occurs
+      during output or an output connection was not previously
+      established.
+  */
+  void sendShortMessage( unsigned char status, unsigned char data1 = 0, unsigned char data2 = 0 );
+
+  //! Immediately send a group of short messages out an open MIDI output port.
+  /*!
+      The messages are sent in order, as with repeated calls to
+      sendShortMessage(), but APIs which buffer their output (ALSA)
+      flush it only once for the whole group, so a chord or a panic
+      costs a single round-trip to the driver.
+  */
+  void sendShortMessages( const ShortMessage *messages, unsigned int count );
+
+  //! Send a short message out an open MIDI output port after the given delay.
+  /*!
+      The \e delay is given in seconds, starting from the time of the
+      call.  The message is handed to the API at once and it is the
+      API which delivers it in time (an ALSA sequencer queue, a JACK
+      frame offset, a CoreMIDI timestamp), so its timing does not
+      depend on the scheduling of the calling thread.  APIs without
+      output scheduling (Windows, dummy) send the message immediately.
+      A delay <= 0 is the same as calling sendShortMessage().
+  */
+  void scheduleShortMessage( double delay, unsigned char status, unsigned char data1 = 0, unsigned char data2 = 0 );
+
  protected:
-  void openMidiApi( RtMidi::Api api, const std::string clientName );
+  void openMidiApi( RtMidi::Api api, const std::string clientName, unsigned int bufferSize );
   MidiOutApi *rtapi_;
 };
 
@@ -343,11 +456,13 @@ class MidiInApi
   virtual void openVirtualPort( const std::string portName ) = 0;
   virtual void closePort( void ) = 0;
   void setCallback( RtMidiIn::RtMidiCallback callback, void *userData );
+  void setBatchCallback( RtMidiIn::RtMidiBatchCallback callback, void *userData );
   void cancelCallback( void );
   virtual unsigned int getPortCount( void ) = 0;
   virtual std::string getPortName( unsigned int portNumber ) = 0;
   virtual void ignoreTypes( bool midiSysex, bool midiTime, bool midiSense );
   double getMessage( std::vector<unsigned char> *message );
+  double getMessage( unsigned char *buffer, unsigned int *size );
 
   // A MIDI structure used internally by the class to store incoming
   // messages.  Each message represents one and only one MIDI message.
@@ -360,16 +475,67 @@ class MidiInApi
   :bytes(0), timeStamp(0.0) {}
   };
 
+  // The queue of the incoming messages, used when there is no user
+  // callback.  Its slots have a fixed size, so the input thread never
+  // allocates memory: the short messages are stored in the slots and
+  // the longer ones (SysEx) in the slab, a byte ring allocated once.
+  // A message which doesn't fit is dropped.
+  // It is a lock-free single producer / single consumer queue: the
+  // input thread (or callback) only pushes, getMessage() only peeks
+  // and pops.  Each index is written by one side only and published
+  // with release / acquire ordering, so there is no shared counter.
   struct MidiQueue {
-    unsigned int front;
-    unsigned int back;
-    unsigned int size;
-    unsigned int ringSize;
-    MidiMessage *ring;
+    enum { SLOT_BYTES = 12, SLAB_SIZE = 65536 };   // SLAB_SIZE is a power of 2
+
+    struct Slot {
+      unsigned char bytes[SLOT_BYTES];   // a short message
+      unsigned int size;
+      unsigned int slabStart;            // a long message: its position in the
+      unsigned int slabEnd;              // slab (free running counters)
+      double timeStamp;
+    };
+
+    std::atomic<unsigned int> front;     // written by the consumer only
+    std::atomic<unsigned int> back;      // written by the producer only
+    unsigned int ringSize;               // the queue size limit + 1 (an empty
+    Slot *ring;                          // slot tells full from empty)
+    unsigned char *slab;
+    std::atomic<unsigned int> slabFront; // written by the consumer only
+    unsigned int slabBack;               // used by the producer only
 
     // Default constructor.
   MidiQueue()
-  :front(0), back(0), size(0), ringSize(0) {}
+  :front(0), back(0), ringSize(0), ring(0), slab(0), slabFront(0), slabBack(0) {}
+
+    // Appends a message.  Returns false if there is no room for it.
+    bool push( const unsigned char *bytes, unsigned int nBytes, double timeStamp );
+    bool push( const MidiMessage &message )
+    { return push( message.bytes.empty() ? 0 : &message.bytes[0], message.bytes.size(), message.timeStamp ); }
+
+    // Returns the first message (0 if the queue is empty) and its bytes.
+    const Slot *peek( void ) const
+    {
+      unsigned int f = front.load( std::memory_order_relaxed );
+      return f == back.load( std::memory_order_acquire ) ? 0 : &ring[f];
+    }
+    const unsigned char *data( const Slot *s ) const
+    { return s->size <= SLOT_BYTES ? s->bytes : slab + ( s->slabStart & ( SLAB_SIZE - 1 ) ); }
+
+    // Returns the number of messages, and the message i (i < count()).
+    unsigned int count( void ) const
+    {
+      unsigned int f = front.load( std::memory_order_relaxed );
+      unsigned int b = back.load( std::memory_order_acquire );
+      return b >= f ? b - f : b + ringSize - f;
+    }
+    const Slot *peek( unsigned int i ) const
+    {
+      unsigned int s = front.load( std::memory_order_relaxed ) + i;
+      return &ring[ s >= ringSize ? s - ringSize : s ];
+    }
+
+    // Removes the first message.
+    void pop( void );
   };
 
   // The RtMidiInData structure is used to pass private class data to
@@ -381,18 +547,43 @@ class MidiInApi
     bool doInput;
     bool firstMessage;
     void *apiData;
-    bool usingCallback;
-    void *userCallback;
+    std::atomic<bool> usingCallback;           // the callbacks can be cancelled
+    std::atomic<void *> userCallback;          // while the input thread runs
     void *userData;
     bool continueSysex;
+    std::atomic<bool> usingBatch;              // with usingCallback: the messages
+    std::atomic<void *> batchCallback;         // are gathered in the queue and
+    void *batchUserData;                       // passed by dispatchBatch()
+    std::vector<RtMidiIn::BatchMessage> batch;
+    std::atomic<bool> callbackBusy;            // the input thread is calling back
 
     // Default constructor.
   RtMidiInData()
   : ignoreFlags(7), doInput(false), firstMessage(true),
       apiData(0), usingCallback(false), userCallback(0), userData(0),
-      continueSysex(false) {}
+      continueSysex(false), usingBatch(false), batchCallback(0), batchUserData(0),
+      callbackBusy(false) {}
   };
 
+  // While it exists the input thread is calling back: cancelCallback()
+  // waits for its end.  Load the callback after creating it.
+  struct CallbackGuard {
+    RtMidiInData *data;
+    static thread_local RtMidiInData *current;   // the data of the callback run by this thread
+
+  CallbackGuard( RtMidiInData *d ) : data( d ) { data->callbackBusy.store( true ); current = d; }
+  ~CallbackGuard() { current = 0; data->callbackBusy.store( false, std::memory_order_release ); }
+  };
+
+  // Passes a message to the user callback, if it is still set (called by
+  // the input thread).
+  static void callUserCallback( RtMidiInData *data, double timeStamp, std::vector<unsigned char> *message );
+
+  // Passes all the messages in the queue to the batch callback and
+  // removes them (called by the input thread).  If the callback has been
+  // cancelled the messages are left in the queue.
+  static void dispatchBatch( RtMidiInData *data );
+
  protected:
   virtual void initialize( const std::string& clientName ) = 0;
   RtMidiInData inputData_;
@@ -415,6 +606,16 @@ class MidiOutApi
   virtual unsigned int getPortCount( void ) = 0;
   virtual std::string getPortName( unsigned int portNumber ) = 0;
   virtual void sendMessage( std::vector<unsigned char> *message ) = 0;
+  virtual void sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 ) = 0;
+  virtual void sendShortMessages( const RtMidiOut::ShortMessage *messages, unsigned int count );
+  virtual void scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 );
+  virtual void getPortList( std::vector<RtMidiOut::PortInfo> &ports );
+  virtual void setPortChangeCallback( RtMidiOut::RtMidiPortChangeCallback callback, void *userData );
+
+  // Returns the total length (status included) of the short message
+  // beginning with the given status byte, or 0 if it is not a valid
+  // status byte for sendShortMessage() (data bytes and sysex).
+  static unsigned int shortMessageSize( unsigned char status );
 
  protected:
   virtual void initialize( const std::string& clientName ) = 0;
@@ -435,11 +636,13 @@ inline void RtMidiIn :: openPort( unsigned int portNumber, const std::string por
 inline void RtMidiIn :: openVirtualPort( const std::string portName ) { return rtapi_->openVirtualPort( portName ); }
 inline void RtMidiIn :: closePort( void ) { return rtapi_->closePort(); }
 inline void RtMidiIn :: setCallback( RtMidiCallback callback, void *userData ) { return rtapi_->setCallback( callback, userData ); }
+inline void RtMidiIn :: setBatchCallback( RtMidiBatchCallback callback, void *userData ) { return rtapi_->setBatchCallback( callback, userData ); }
 inline void RtMidiIn :: cancelCallback( void ) { return rtapi_->cancelCallback(); }
 inline unsigned int RtMidiIn :: getPortCount( void ) { return rtapi_->getPortCount(); }
 inline std::string RtMidiIn :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
 inline void RtMidiIn :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense ) { return rtapi_->ignoreTypes( midiSysex, midiTime, midiSense ); }
 inline double RtMidiIn :: getMessage( std::vector<unsigned char> *message ) { return rtapi_->getMessage( message ); }
+inline double RtMidiIn :: getMessage( unsigned char *buffer, unsigned int *size ) { return rtapi_->getMessage( buffer, size ); }
 
 inline RtMidi::Api RtMidiOut :: getCurrentApi( void ) throw() { return rtapi_->getCurrentApi(); }
 inline void RtMidiOut :: openPort( unsigned int portNumber, const std::string portName ) { return rtapi_->openPort( portNumber, portName ); }
@@ -448,6 +651,11 @@ inline void RtMidiOut :: closePort( void ) { return rtapi_->closePort(); }
 inline unsigned int RtMidiOut :: getPortCount( void ) { return rtapi_->getPortCount(); }
 inline std::string RtMidiOut :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
 inline void RtMidiOut :: sendMessage( std::vector<unsigned char> *message ) { return rtapi_->sendMessage( message ); }
+inline void RtMidiOut :: sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 ) { return rtapi_->sendShortMessage( status, data1, data2 ); }
+inline void RtMidiOut :: sendShortMessages( const ShortMessage *messages, unsigned int count ) { return rtapi_->sendShortMessages( messages, count ); }
+inline void RtMidiOut :: getPortList( std::vector<PortInfo> &ports ) { return rtapi_->getPortList( ports ); }
+inline void RtMidiOut :: setPortChangeCallback( RtMidiPortChangeCallback callback, void *userData ) { return rtapi_->setPortChangeCallback( callback, userData ); }
+inline void RtMidiOut :: scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 ) { return rtapi_->scheduleShortMessage( delay, status, data1, data2 ); }
 
 // **************************************************************** //
 //
@@ -489,9 +697,12 @@ class MidiOutCore: public MidiOutApi
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
   void sendMessage( std::vector<unsigned char> *message );
+  void sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 );
+  void scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 );
 
  protected:
   void initialize( const std::string& clientName );
+  void sendPacket( const unsigned char *bytes, unsigned int nBytes, double delay = 0.0 );
 };
 
 #endif
@@ -517,7 +728,7 @@ class MidiInJack: public MidiInApi
 class MidiOutJack: public MidiOutApi
 {
  public:
-  MidiOutJack( const std::string clientName );
+  MidiOutJack( const std::string clientName, unsigned int bufferSize );
   ~MidiOutJack( void );
   RtMidi::Api getCurrentApi( void ) { return RtMidi::UNIX_JACK; };
   void openPort( unsigned int portNumber, const std::string portName );
@@ -526,9 +737,14 @@ class MidiOutJack: public MidiOutApi
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
   void sendMessage( std::vector<unsigned char> *message );
+  void sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 );
+  void scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 );
+  void getPortList( std::vector<RtMidiOut::PortInfo> &ports );
+  void setPortChangeCallback( RtMidiOut::RtMidiPortChangeCallback callback, void *userData );
 
  protected:
   void initialize( const std::string& clientName );
+  unsigned int bufferSize_;
 };
 
 #endif
@@ -563,6 +779,11 @@ class MidiOutAlsa: public MidiOutApi
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
   void sendMessage( std::vector<unsigned char> *message );
+  void sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 );
+  void sendShortMessages( const RtMidiOut::ShortMessage *messages, unsigned int count );
+  void scheduleShortMessage( double delay, unsigned char status, unsigned char data1, unsigned char data2 );
+  void getPortList( std::vector<RtMidiOut::PortInfo> &ports );
+  void setPortChangeCallback( RtMidiOut::RtMidiPortChangeCallback callback, void *userData );
 
  protected:
   void initialize( const std::string& clientName );
@@ -600,6 +821,7 @@ class MidiOutWinMM: public MidiOutApi
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
   void sendMessage( std::vector<unsigned char> *message );
+  void sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 );
 
  protected:
   void initialize( const std::string& clientName );
@@ -637,9 +859,11 @@ class MidiOutWinKS: public MidiOutApi
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
   void sendMessage( std::vector<unsigned char> *message );
+  void sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 );
 
  protected:
   void initialize( const std::string& clientName );
+  void writeBytes( const unsigned char *bytes, size_t nBytes );
 };
 
 #endif
@@ -672,6 +896,7 @@ class MidiOutDummy: public MidiOutApi
   unsigned int getPortCount( void ) { return 0; };
   std::string getPortName( unsigned int portNumber ) { return ""; };
   void sendMessage( std::vector<unsigned char> *message ) {};
+  void sendShortMessage( unsigned char status, unsigned char data1, unsigned char data2 ) {};
 
  protected:
   void initialize( const std::string& clientName ) {};
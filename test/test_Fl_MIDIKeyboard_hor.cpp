@@ -112,7 +112,7 @@ void setcallback_cb(Fl_Widget* w, void* p) {
 // sets all the midi parameters of the MKB_MIDIDriver
 void setmidi_cb(Fl_Widget* w, void* p) {
     if (w == choice_port)
-        kb->SetActivePort(((Fl_Choice *)w)->value());
+        kb->SetActivePortAsync(((Fl_Choice *)w)->value());
     else if (w == spinner_chan)
         kb->SetChannel(((Fl_Spinner *)w)->value()-1);
     else if (w == spinner_program)
@@ -125,6 +125,14 @@ void setmidi_cb(Fl_Widget* w, void* p) {
         kb->SetNoteVel(((Fl_Spinner *)w)->value());
 }
 
+// rebuilds the port menu when MIDI ports are plugged or unplugged (the driver keeps the active port)
+void setports_cb(MKB_MIDIDriver* d, void* p) {
+    choice_port->clear();
+    for (int i = 0; i < d->GetNumMIDIOutDevs(); i++)
+        choice_port->add(d->GetMIDIOutDevName(i));
+    choice_port->value(d->GetActivePort());
+}
+
 // turns on and off the autoresize mode (try it with a small number of keys): value is given by
 // the Fl_Check_Button check_autoresize
 void autoresize_cb(Fl_Widget* w, void* p) {
@@ -268,6 +276,7 @@ int main (int argc, char ** argv) {
     choice_port->value(0);
     choice_port->callback(setmidi_cb);
     choice_port->do_callback();
+    kb->SetDevsChangedCallback(setports_cb);
     spinner_chan = new Fl_Spinner(540, 270, 60, 20, "MIDI Channel");
     spinner_chan->range(1, 16);
     spinner_chan->value(kb->GetChannel());
@@ -310,5 +319,6 @@ int main (int argc, char ** argv) {
 
     Fl::add_idle(setoutput_to);
 
+    Fl::lock();                     // enables Fl::awake(), used by the driver for port changes
     return(Fl::run());
 }
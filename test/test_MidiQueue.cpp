@@ -0,0 +1,88 @@
+/// \file
+/// This file contains a stress test for the lock-free queue of the RtMidi input (MidiInApi::MidiQueue). A
+/// producer thread pushes numbered messages (mostly short, one in 50 a sysex of 13 to 4012 bytes) into a
+/// small queue, while the main thread pops them, checking their order, size, time stamp and bytes. The
+/// number of messages can be given on the command line (default 2000000). It returns 0 if all the messages
+/// were received unchanged.
+/// Compile it with src/rtmidi-2.0.1/RtMidi.cpp.
+
+
+#include "../src/rtmidi-2.0.1/RtMidi.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+typedef MidiInApi::MidiQueue MidiQueue;
+
+const unsigned int QUEUE_SIZE = 100;                    // small, so the queue is often full
+const unsigned int SYSEX_EVERY = 50;
+
+
+// returns the size of the message seq
+unsigned int message_size(unsigned int seq) {
+    return seq % SYSEX_EVERY == 0 ? 13 + seq % 4000 : 3;
+}
+
+// fills the message seq: its first three bytes are the number, the others a pattern
+void make_message(unsigned int seq, std::vector<unsigned char>& m) {
+    unsigned int n = message_size(seq);
+    for (unsigned int i = 3; i < n; i++)
+        m[i] = (unsigned char)(seq * 7 + i);
+    m[0] = seq & 0xff;
+    m[1] = (seq >> 8) & 0xff;
+    m[2] = (seq >> 16) & 0xff;
+}
+
+// pushes the messages, retrying when the queue is full
+void producer(MidiQueue* q, unsigned int count) {
+    std::vector<unsigned char> m(13 + 4000);
+    for (unsigned int seq = 0; seq < count; ) {
+        make_message(seq, m);
+        if (q->push(&m[0], message_size(seq), seq))
+            seq++;
+        else
+            std::this_thread::yield();
+    }
+}
+
+
+int main(int argc, char **argv) {
+    unsigned int count = argc > 1 ? strtoul(argv[1], 0, 10) : 2000000;
+
+    MidiQueue q;
+    q.ringSize = QUEUE_SIZE + 1;
+    q.ring = new MidiQueue::Slot[q.ringSize];
+    q.slab = new unsigned char[MidiQueue::SLAB_SIZE];
+
+    std::thread prod(producer, &q, count);
+    std::vector<unsigned char> m(13 + 4000);
+    unsigned int received = 0, bad = 0;
+    while (received < count) {
+        const MidiQueue::Slot* s = q.peek();
+        if (!s) {
+            std::this_thread::yield();
+            continue;
+        }
+        const unsigned char* d = q.data(s);
+        unsigned int n = message_size(received);
+        make_message(received, m);
+        bool ok = s->size == n && s->timeStamp == received;
+        for (unsigned int i = 0; ok && i < n; i++)
+            ok = d[i] == m[i];
+        if (!ok) {
+            if (bad < 10)
+                printf("message %u: wrong size, time stamp or bytes\n", received);
+            bad++;
+        }
+        q.pop();
+        received++;
+    }
+    prod.join();
+    printf("received %u messages, %u bad\n", received, bad);
+
+    delete[] q.ring;
+    delete[] q.slab;
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+/// \file
+/// This file contains a check program for Fl_MIDIKeyboard::find_key(). For many ranges, key widths and
+/// black/white ratios it compares, at every pixel of the keyboard, the key returned by the per-pixel
+/// tables with the one given by the old binary search over the key offsets. It prints the mismatches (if
+/// any) and returns 0 if there are none.
+
+
+#include <FL/Fl.H>
+#include <FL/Fl_Window.H>
+
+#include "../src/Fl_MIDIKeyboard.h"
+
+#include <cstdio>
+
+
+// a keyboard which gives access to find_key() and to the old binary search
+class Test_Keyboard : public Fl_MIDIKeyboard {
+    public:
+        Test_Keyboard(int X, int Y, int W, int H) :
+            Fl_MIDIKeyboard(X, Y, W, H, MKB_MIDIDriver::DISPLAY_ONLY) {}
+
+        // returns the key at X, Y as find_key() does
+        short new_find(int X, int Y)
+                        { return find_key(X, Y); }
+
+        // returns the key at offset off (along the keyboard) and depth (along the keys) as the old
+        // find_key() did, with the offsets computed from the public layout values
+        short old_find(int off, int depth);
+
+        // returns the internal keyboard box (the only child which is not a scrollbar)
+        Fl_Widget* keyboard_box();
+
+        // checks every pixel of the current layout, returning the number of mismatches
+        long check(long& checked);
+};
+
+
+short Test_Keyboard::old_find(int off, int depth) {
+    int b_width = (int)(key_width() * bw_width_ratio());
+    int b_height = (int)(key_height() * bw_height_ratio());
+    int keyscoord[128];
+    float offs = 0.0;
+    for (int i = first_key(); i <= last_key(); i++) {
+        keyscoord[i] = (int)offs;
+        if (is_black(i))
+            keyscoord[i] -= (int)(b_width / 2);
+        else
+            offs += key_width();
+    }
+    if (off < 0 || depth < 0 || off > total_width()) return -1;
+    uchar min = first_key(), max = last_key(), mid = min + (max - min) / 2;
+    if (off >= keyscoord[max]) return max;
+    do {
+        if (off >= keyscoord[mid]) min = mid;
+        else max = mid;
+        mid = min + (max - min) / 2;
+    } while (max - min > 1);
+    if (depth > b_height) return (is_black(min) ? mid - 1 : mid);
+    else if (is_black(mid)) return mid;
+    else if (isCF(mid)) return mid;
+    else if (off - keyscoord[mid] <= b_width / 2 && mid > first_key()) return mid - 1;
+    else return mid;
+}
+
+
+Fl_Widget* Test_Keyboard::keyboard_box() {
+    for (int i = 0; i < children(); i++)
+        if (child(i) != &scrollbar && child(i) != &hscrollbar)
+            return child(i);
+    return 0;
+}
+
+
+long Test_Keyboard::check(long& checked) {
+    Fl_Widget* box = keyboard_box();
+    int b_height = (int)(key_height() * bw_height_ratio());
+    int depths[] = { 0, b_height, b_height + 1, key_height() };
+    long bad = 0;
+    for (int off = 0; off <= total_width(); off++) {
+        for (int d = 0; d < 4; d++) {
+            short o = old_find(off, depths[d]);
+            short n = (type() == MKB_HORIZONTAL ?
+                       new_find(box->x() + off, box->y() + depths[d]) :
+                       new_find(box->x() + depths[d], box->y() + box->h() - off));
+            checked++;
+            if (o != n) {
+                if (bad < 10)
+                    printf("%s range %d-%d width %.2f ratio %.2f off %d depth %d: old %d new %d\n",
+                           type() == MKB_HORIZONTAL ? "hor" : "vert", first_key(), last_key(),
+                           key_width(), bw_width_ratio(), off, depths[d], o, n);
+                bad++;
+            }
+        }
+    }
+    return bad;
+}
+
+
+int main(int argc, char **argv) {
+    Fl_Window* window = new Fl_Window(800, 800);
+    Test_Keyboard* kbds[2] = { new Test_Keyboard(0, 0, 780, 100),       // horizontal
+                               new Test_Keyboard(0, 100, 100, 680) };   // vertical
+    window->end();
+
+    long checked = 0, bad = 0;
+    for (int t = 0; t < 2; t++) {
+        Test_Keyboard* kb = kbds[t];
+        for (int fk = 0; fk < 128; fk += 5) {
+            for (int lk = fk + 12; lk < 128; lk += 7) {
+                if (!kb->set_range(fk, lk)) continue;
+                for (float kw = 4; kw <= 40; kw += 1.37f) {
+                    for (float r = 0.4f; r <= 0.81f; r += 0.1f) {
+                        kb->key_width(kw);
+                        kb->bw_width_ratio(r);
+                        kb->kbd_position(0);
+                        bad += kb->check(checked);
+                    }
+                }
+            }
+        }
+    }
+    printf("checked %ld points, %ld mismatches\n", checked, bad);
+    delete window;
+    return bad ? 1 : 0;
+}